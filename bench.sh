@@ -0,0 +1,27 @@
+#!/bin/sh
+# End-to-end benchmark: starts the server on a scratch port and Unix sockets,
+# runs the load generator over TCP, a Unix stream socket, a Unix seqpacket
+# socket and a shared-memory ring, and stops the server with SIGINT.
+#
+# Usage: bench.sh <chatServer> <loadGenerator> [loadGenerator options...]
+# Server options can be passed in BENCH_SERVER_ARGS, the port in BENCH_PORT.
+
+SERVER=${1:?server binary}
+LOADGEN=${2:?load generator binary}
+shift 2
+PORT=${BENCH_PORT:-18080}
+SOCKET_DIR=$(mktemp -d)
+
+"$SERVER" $BENCH_SERVER_ARGS -l "$PORT" -l "unix:$SOCKET_DIR/stream" -l "unixpacket:$SOCKET_DIR/packet" \
+    -l "shm:$SOCKET_DIR/shm" > /dev/null 2>&1 &
+SERVER_PID=$!
+trap 'kill -INT $SERVER_PID 2>/dev/null; wait $SERVER_PID 2>/dev/null; rm -rf "$SOCKET_DIR"' EXIT
+sleep 0.5
+
+"$LOADGEN" -p "$PORT" -c 20 -n 500 -s 64 "$@"
+echo
+"$LOADGEN" -u "$SOCKET_DIR/stream" -c 20 -n 500 -s 64 "$@"
+echo
+"$LOADGEN" -U "$SOCKET_DIR/packet" -c 20 -n 500 -s 64 "$@"
+echo
+"$LOADGEN" -u "$SOCKET_DIR/shm" -M -c 20 -n 500 -s 64 "$@"
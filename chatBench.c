@@ -0,0 +1,283 @@
+#include "chatServer.h"
+#include <time.h>
+#include <stdint.h>
+#include <dirent.h>
+
+#define BENCH_FANOUT 128
+#define BENCH_MESSAGE_SIZE 64
+#define BENCH_LARGE_MESSAGE_SIZE 16384
+
+/*
+ * In-process micro-benchmarks of the server's message path. Each benchmark
+ * prints the cost per operation so successive builds (Release, PGO, ...) can be
+ * compared without network noise.
+ */
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void benchCapitalize(void)
+{
+    char buffer[BUFFER_SIZE];
+    for (int i = 0; i < BUFFER_SIZE; i++)
+        buffer[i] = (char)('a' + i % 26);
+
+    const int iterations = 200000;
+    uint64_t start = nowNs();
+    for (int i = 0; i < iterations; i++)
+    {
+        capitalizeMessage(buffer, BUFFER_SIZE);
+        buffer[i % BUFFER_SIZE] = 'a'; // Keep the compiler from hoisting the work
+    }
+    uint64_t elapsed = nowNs() - start;
+
+    printf("capitalizeMessage: %.3f ns/byte\n", (double)elapsed / ((double)iterations * BUFFER_SIZE));
+}
+
+/*
+ * Runs chat-sized messages through a transform pipeline, showing what the dispatch
+ * between the stages costs per message.
+ */
+static void benchTransforms(const char* spec)
+{
+    transform_pipeline_t pipeline;
+    if (parseTransforms(spec, &pipeline) != 0)
+    {
+        fprintf(stderr, "Invalid transforms %s\n", spec);
+        exit(EXIT_FAILURE);
+    }
+
+    char buffer[BENCH_MESSAGE_SIZE + TRANSFORM_MAX_GROWTH];
+    transform_rate_t rate = { 0, 0 };
+    transform_ctx_t ctx = { 0, &rate };
+    const int iterations = 2000000;
+    uint64_t start = nowNs();
+    for (int i = 0; i < iterations; i++)
+    {
+        memset(buffer, 'a' + i % 26, BENCH_MESSAGE_SIZE);
+        applyTransforms(&pipeline, buffer, BENCH_MESSAGE_SIZE, &ctx);
+    }
+    uint64_t elapsed = nowNs() - start;
+
+    printf("transforms %s (%d-byte messages): %.1f ns/message\n", spec, BENCH_MESSAGE_SIZE,
+           (double)elapsed / iterations);
+}
+
+/*
+ * Broadcasts messages of the given size to BENCH_FANOUT socketpair-backed connections
+ * and flushes them, measuring the enqueue and write cost per delivered message.
+ * Messages of at least zerocopy_threshold bytes are shared between the queues.
+ */
+static void benchFanout(int size, int zerocopy_threshold, int rounds)
+{
+    conn_pool_t pool;
+    initPool(&pool);
+    pool.config.zerocopy_threshold = zerocopy_threshold;
+
+    int peers[BENCH_FANOUT];
+    for (int i = 0; i < BENCH_FANOUT; i++)
+    {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        {
+            perror("socketpair failed");
+            exit(EXIT_FAILURE);
+        }
+        int on = 1;
+        ioctl(sv[0], FIONBIO, (char*)&on);
+        addConn(sv[0], &pool);
+        pool.conns_by_fd[sv[0]]->protocol = PROTO_TEXT; // As if the client had spoken, so nothing is held
+        peers[i] = sv[1];
+    }
+    updateMaxFd(&pool);
+
+    char* message = (char*) malloc(size);
+    memset(message, 'x', size);
+    char sink[65536];
+
+    const int burst = 16;
+    uint64_t start = nowNs();
+    for (int round = 0; round < rounds; round++)
+    {
+        for (int i = 0; i < burst; i++)
+            addMsg(-1, message, size - 1, &pool); // The newline is added on delivery
+
+        // Flush and drain until every queue is empty
+        while (pool.dirty_head != NULL)
+        {
+            for (conn_t* conn = pool.dirty_head; conn != NULL; conn = conn->dirty_next)
+                conn->write_blocked = 0;
+            flushPendingWrites(&pool);
+
+            for (int i = 0; i < BENCH_FANOUT; i++)
+                while (recv(peers[i], sink, sizeof(sink), MSG_DONTWAIT) > 0)
+                    ;
+        }
+    }
+    uint64_t elapsed = nowNs() - start;
+
+    printf("fan-out (%d conns, %d-byte msgs%s): %.1f ns/delivered msg\n", BENCH_FANOUT, size,
+           zerocopy_threshold > 0 ? ", shared payloads" : "",
+           (double)elapsed / ((double)rounds * burst * BENCH_FANOUT));
+    free(message);
+
+    while (pool.conn_head != NULL)
+        removeConn(pool.conn_head->fd, &pool);
+    destroyPool(&pool);
+    for (int i = 0; i < BENCH_FANOUT; i++)
+        close(peers[i]);
+}
+
+/*
+ * Replays a full room history to a newly joined connection and flushes it, measuring
+ * the cost per replayed message.
+ */
+static void benchReplay(int history_size, int rounds)
+{
+    conn_pool_t pool;
+    initPool(&pool);
+    pool.config.history_size = history_size;
+
+    char message[BENCH_MESSAGE_SIZE];
+    memset(message, 'x', sizeof(message));
+    for (int i = 0; i < history_size; i++)
+        addMsg(-1, message, sizeof(message) - 1, &pool);
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+        perror("socketpair failed");
+        exit(EXIT_FAILURE);
+    }
+    int on = 1;
+    ioctl(sv[0], FIONBIO, (char*)&on);
+    addConn(sv[0], &pool);
+    conn_t* conn = pool.conns_by_fd[sv[0]];
+    conn->protocol = PROTO_TEXT;
+    char sink[65536];
+
+    uint64_t start = nowNs();
+    for (int round = 0; round < rounds; round++)
+    {
+        replayHistory(conn, &pool);
+        while (conn->write_msg_head != NULL)
+        {
+            conn->write_blocked = 0;
+            flushPendingWrites(&pool);
+            while (recv(sv[1], sink, sizeof(sink), MSG_DONTWAIT) > 0)
+                ;
+        }
+    }
+    uint64_t elapsed = nowNs() - start;
+
+    printf("history replay (%d %d-byte msgs): %.1f ns/replayed msg\n", history_size, BENCH_MESSAGE_SIZE,
+           (double)elapsed / ((double)rounds * history_size));
+
+    removeConn(sv[0], &pool);
+    destroyPool(&pool);
+    close(sv[1]);
+}
+
+/*
+ * Appends messages to a message log in a scratch directory with the given sync
+ * policy, measuring the cost per append seen by the event loop.
+ */
+static void benchLogAppend(const char* sync, int count)
+{
+    char dir[] = "/tmp/chatBench.XXXXXX";
+    int policy, param;
+    if (!mkdtemp(dir) || parseLogSync(sync, &policy, &param) != 0)
+    {
+        perror("mkdtemp failed");
+        return;
+    }
+
+    chat_log_t* log = openLog(dir, policy, param);
+    if (!log)
+        return;
+
+    char message[BENCH_MESSAGE_SIZE];
+    memset(message, 'x', sizeof(message));
+    uint64_t start = nowNs();
+    for (int i = 0; i < count; i++)
+        appendToLog(log, LOBBY_NAME, message, sizeof(message));
+    uint64_t elapsed = nowNs() - start;
+    closeLog(log);
+
+    printf("log append (%d-byte msgs, sync %s): %.1f ns/msg\n", BENCH_MESSAGE_SIZE, sync, (double)elapsed / count);
+
+    // Remove the scratch log.
+    DIR* dp = opendir(dir);
+    struct dirent* entry;
+    char path[sizeof(dir) + 256];
+    while (dp && (entry = readdir(dp)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        unlink(path);
+    }
+    if (dp)
+        closedir(dp);
+    rmdir(dir);
+}
+
+static void countExpiredTimer(chat_timer_t* timer, void* arg)
+{
+    (void)timer;
+    (*(int*)arg)++;
+}
+
+/*
+ * Schedules one timer per connection, reschedules them all as idle checks of busy
+ * connections would, and lets the wheel expire them, measuring the cost per operation.
+ */
+static void benchTimers(int count)
+{
+    timer_wheel_t* wheel = (timer_wheel_t*) malloc(sizeof(timer_wheel_t));
+    chat_timer_t* timers = (chat_timer_t*) malloc(sizeof(chat_timer_t) * count);
+    long long now = 0;
+    initTimerWheel(wheel, now);
+    for (int i = 0; i < count; i++)
+        initTimer(&timers[i], countExpiredTimer, NULL);
+
+    uint64_t start = nowNs();
+    for (int i = 0; i < count; i++)
+        scheduleTimer(wheel, &timers[i], 30000 + i % 1000);
+    for (int i = 0; i < count; i++)
+        scheduleTimer(wheel, &timers[i], 60000 + i % 1000);
+    uint64_t scheduled = nowNs();
+
+    int expired = 0;
+    while (expired < count)
+    {
+        now += nextTimerTimeout(wheel);
+        advanceTimers(wheel, now, &expired);
+    }
+    uint64_t elapsed = nowNs() - scheduled;
+
+    printf("timer wheel (%d timers): %.1f ns/schedule, %.1f ns/expiry\n", count,
+           (double)(scheduled - start) / (2.0 * count), (double)elapsed / count);
+    free(timers);
+    free(wheel);
+}
+
+int main(void)
+{
+    benchCapitalize();
+    benchTransforms("uppercase");
+    benchTransforms("uppercase,strip");
+    benchTransforms("uppercase,profanity,cap=200,ratetag=1000000000");
+    benchFanout(BENCH_MESSAGE_SIZE, 0, 2000);
+    benchFanout(BENCH_LARGE_MESSAGE_SIZE, 0, 50);
+    benchFanout(BENCH_LARGE_MESSAGE_SIZE, BENCH_LARGE_MESSAGE_SIZE / 2, 50);
+    benchReplay(1024, 200);
+    benchLogAppend("none", 1000000);
+    benchLogAppend("every:64", 1000000);
+    benchTimers(100000);
+    return 0;
+}
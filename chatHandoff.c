@@ -0,0 +1,503 @@
+#include "chatHandoff.h"
+#include <sys/un.h>
+
+/*
+ * Sends one handoff message, with a descriptor attached unless fd is -1.
+ */
+static int sendWithFd(int sock, const void* data, size_t len, int fd)
+{
+    struct iovec iov = { (void*)data, len };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd >= 0)
+    {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t)len)
+    {
+        perror("Error sending handoff message");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Receives one handoff message of exactly len bytes and the descriptor attached to it,
+ * if any (fd is set to -1 otherwise).
+ */
+static int receiveWithFd(int sock, void* data, size_t len, int* fd)
+{
+    struct iovec iov = { data, len };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(sock, &msg, 0);
+
+    int passed = -1;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); received >= 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&passed, CMSG_DATA(cmsg), sizeof(int));
+
+    if (received != (ssize_t)len || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+    {
+        if (received < 0)
+            perror("Error receiving handoff message");
+        else
+            fprintf(stderr, "Unexpected handoff message\n");
+        if (passed >= 0)
+            close(passed);
+        return -1;
+    }
+
+    if (fd)
+        *fd = passed;
+    else if (passed >= 0)
+        close(passed);
+    return 0;
+}
+
+/*
+ * Sends a run of bytes in messages of up to HANDOFF_CHUNK_SIZE bytes.
+ */
+static int sendBytes(int sock, const char* data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t part = len < HANDOFF_CHUNK_SIZE ? len : HANDOFF_CHUNK_SIZE;
+        if (sendWithFd(sock, data, part, -1) != 0)
+            return -1;
+        data += part;
+        len -= part;
+    }
+    return 0;
+}
+
+/*
+ * Receives the next message of a run of bytes, of at most len bytes.
+ */
+static ssize_t receiveBytes(int sock, char* data, size_t len)
+{
+    if (len > HANDOFF_CHUNK_SIZE)
+        len = HANDOFF_CHUNK_SIZE;
+
+    ssize_t received = recv(sock, data, len, 0);
+    if (received <= 0)
+    {
+        if (received < 0)
+            perror("Error receiving handoff message");
+        else
+            fprintf(stderr, "Handoff connection closed\n");
+        return -1;
+    }
+    return received;
+}
+
+/*
+ * Sends a connection's socket and state to the successor.
+ */
+static int sendConn(int sock, const conn_t* conn, const conn_pool_t* pool)
+{
+    handoff_conn_t state;
+    memset(&state, 0, sizeof(state));
+    state.protocol = conn->protocol;
+    state.seqpacket = conn->seqpacket;
+    state.ring = conn->ring != NULL;
+    state.zerocopy = conn->zerocopy;
+    state.zc_next_seq = conn->zc_next_seq;
+    state.zc_pending = conn->zc_head != NULL;
+    state.read_len = (uint32_t)conn->read_len;
+    int held = conn->protocol == PROTO_UNKNOWN;
+    for (const msg_t* msg = conn->write_msg_head; msg != NULL; msg = msg->next)
+        state.write_len += held ? (uint32_t)(FRAME_HEADER_SIZE + msg->payload->size) : (uint32_t)(msg->size - msg->offset);
+    memcpy(state.room, pool->rooms[conn->room]->name, ROOM_NAME_SIZE);
+    memcpy(state.nick, conn->nick, NICK_SIZE);
+
+    if (sendWithFd(sock, &state, sizeof(state), conn->fd) != 0)
+        return -1;
+
+    // Records left in the ring stay there for the successor.
+    uint32_t marker = SHM_RING_MAGIC;
+    if (conn->ring &&
+        (sendWithFd(sock, &marker, sizeof(marker), conn->ring->memfd) != 0 ||
+         sendWithFd(sock, &marker, sizeof(marker), conn->ring->eventfd) != 0))
+        return -1;
+
+    if (sendBytes(sock, conn->read_buf, conn->read_len) != 0)
+        return -1;
+
+    // The output goes over as is; chunk boundaries do not matter to the successor. The
+    // broadcasts held for a connection whose protocol is unknown go over as frames, so
+    // that the successor can still encode them either way.
+    for (const msg_t* msg = conn->write_msg_head; msg != NULL; msg = msg->next)
+    {
+        int result = held ? sendBytes(sock, msg->payload->data, FRAME_HEADER_SIZE + msg->payload->size)
+                          : sendBytes(sock, msg->message + msg->offset, msg->size - msg->offset);
+        if (result != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Receives the broadcasts held for a connection whose protocol is unknown and holds them
+ * again. Each comes as a frame in messages of its own.
+ */
+static int receiveHeld(int sock, conn_t* conn, uint32_t len, conn_pool_t* pool)
+{
+    char buffer[HANDOFF_CHUNK_SIZE];
+    while (len > 0)
+    {
+        ssize_t part = receiveBytes(sock, buffer, len);
+        if (part < 0)
+            return -1;
+
+        frame_header_t header;
+        if (part >= FRAME_HEADER_SIZE)
+            decodeFrameHeader(buffer, &header);
+        if (part < FRAME_HEADER_SIZE || header.length > len - FRAME_HEADER_SIZE ||
+            (uint32_t)part > FRAME_HEADER_SIZE + header.length)
+        {
+            fprintf(stderr, "Invalid handoff message\n");
+            return -1;
+        }
+
+        char* body = (char*) malloc(header.length + 1);
+        if (!body)
+        {
+            fprintf(stderr, "malloc failed\n");
+            return -1;
+        }
+        uint32_t received = (uint32_t)part - FRAME_HEADER_SIZE;
+        memcpy(body, buffer + FRAME_HEADER_SIZE, received);
+        while (received < header.length && (part = receiveBytes(sock, body + received, header.length - received)) > 0)
+            received += (uint32_t)part;
+
+        // Room ids are the old server's; the message belongs to the connection's room.
+        payload_t* payload = received == header.length ? createPayload(header.type, conn->room, body, (int)header.length) : NULL;
+        free(body);
+        int result = payload ? enqueuePayload(conn, payload, pool) : -1;
+        releasePayload(payload);
+        if (result != 0)
+            return -1;
+        len -= FRAME_HEADER_SIZE + header.length;
+    }
+    return 0;
+}
+
+/*
+ * Receives a connection from the old server and adds it to the pool.
+ */
+static int receiveConn(int sock, conn_pool_t* pool)
+{
+    handoff_conn_t state;
+    int fd;
+    if (receiveWithFd(sock, &state, sizeof(state), &fd) != 0)
+        return -1;
+    if (fd < 0 || state.read_len > READ_BATCH_SIZE)
+    {
+        fprintf(stderr, "Invalid handoff connection\n");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (addConn(fd, pool) != 0)
+        return -1;
+
+    conn_t* conn = pool->conns_by_fd[fd];
+    conn->protocol = state.protocol;
+    conn->seqpacket = state.seqpacket;
+
+    if (state.ring)
+    {
+        uint32_t marker;
+        int memfd = -1, eventfd = -1;
+        shm_ring_t ring;
+        if (receiveWithFd(sock, &marker, sizeof(marker), &memfd) != 0 || memfd < 0 ||
+            receiveWithFd(sock, &marker, sizeof(marker), &eventfd) != 0 || eventfd < 0)
+        {
+            if (memfd >= 0)
+                close(memfd);
+            return -1;
+        }
+        if (attachShmRing(&ring, memfd, eventfd) != 0 || setConnRing(conn, &ring, pool) != 0)
+            return -1;
+    }
+    conn->zerocopy = state.zerocopy;
+    conn->zc_next_seq = state.zc_next_seq;
+
+    state.room[ROOM_NAME_SIZE - 1] = '\0';
+    state.nick[NICK_SIZE - 1] = '\0';
+    int room = findOrCreateRoom(pool, state.room);
+    if (room < 0 || joinRoom(conn, room, pool) != 0)
+        fprintf(stderr, "Cannot restore room %s of sd %d\n", state.room, fd);
+    if (state.nick[0] != '\0' && setNick(conn, state.nick, pool) != 0)
+        fprintf(stderr, "Cannot restore nickname %s of sd %d\n", state.nick, fd);
+
+    // Completions of the old server's zero-copy sends still arrive on the socket's
+    // error queue; a pending entry without a payload makes sure they are reaped.
+    if (state.zc_pending)
+    {
+        zc_pending_t* pending = (zc_pending_t*) malloc(sizeof(zc_pending_t));
+        if (pending)
+        {
+            pending->next = NULL;
+            pending->seq = conn->zc_next_seq - 1;
+            pending->payload = NULL;
+            conn->zc_head = conn->zc_tail = pending;
+        }
+    }
+
+    // Unprocessed input goes back into the read buffer.
+    if ((int)state.read_len > conn->read_cap)
+    {
+        char* read_buf = (char*) realloc(conn->read_buf, state.read_len);
+        if (!read_buf)
+        {
+            fprintf(stderr, "malloc failed\n");
+            return -1;
+        }
+        conn->read_buf = read_buf;
+        conn->read_cap = (int)state.read_len;
+    }
+    for (uint32_t received = 0; received < state.read_len; )
+    {
+        ssize_t part = receiveBytes(sock, conn->read_buf + received, state.read_len - received);
+        if (part < 0)
+            return -1;
+        received += (uint32_t)part;
+    }
+    conn->read_len = (int)state.read_len;
+
+    // Queued output is queued again.
+    if (conn->protocol == PROTO_UNKNOWN)
+        return receiveHeld(sock, conn, state.write_len, pool);
+    char buffer[HANDOFF_CHUNK_SIZE];
+    for (uint32_t received = 0; received < state.write_len; )
+    {
+        ssize_t part = receiveBytes(sock, buffer, state.write_len - received);
+        if (part < 0 || enqueueMessage(conn, buffer, (int)part, pool) != 0)
+            return -1;
+        received += (uint32_t)part;
+    }
+
+    return 0;
+}
+
+/*
+ * Fills in the address of the handoff socket at the given path.
+ */
+static int handoffAddress(const char* path, struct sockaddr_un* addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        fprintf(stderr, "Handoff path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int listenForHandoff(const char* path)
+{
+    struct sockaddr_un addr;
+    if (handoffAddress(path, &addr) != 0)
+        return -1;
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0)
+    {
+        perror("Error creating handoff socket");
+        return -1;
+    }
+
+    // The server handing over removed its socket file, so only a stale one can be left.
+    if (removeStaleSocket(path, SOCK_SEQPACKET) != 0)
+    {
+        close(sock);
+        return -1;
+    }
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 1) < 0)
+    {
+        perror("Error binding handoff socket");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+void closeHandoffSocket(conn_pool_t* pool)
+{
+    if (pool->handoff_socket == -1)
+        return;
+    FD_CLR(pool->handoff_socket, &pool->read_set);
+    close(pool->handoff_socket);
+    pool->handoff_socket = -1;
+    updateMaxFd(pool);
+}
+
+int handOffServer(conn_pool_t* pool)
+{
+    int sock = accept(pool->handoff_socket, NULL, NULL);
+    if (sock < 0)
+    {
+        perror("accept failed");
+        return -1;
+    }
+    PRINT_INFO(pool, "Handing %u connections over to a new server\n", pool->nr_conns);
+
+    handoff_header_t header = { HANDOFF_MAGIC, pool->nr_listeners, pool->nr_conns };
+    int result = sendWithFd(sock, &header, sizeof(header), -1);
+    for (unsigned int i = 0; i < pool->nr_listeners && result == 0; i++)
+    {
+        handoff_listener_t listener;
+        memset(&listener, 0, sizeof(listener));
+        listener.family = pool->listeners[i].family;
+        listener.type = pool->listeners[i].type;
+        listener.shm = pool->listeners[i].shm;
+        memcpy(listener.path, pool->listeners[i].path, sizeof(listener.path));
+        result = sendWithFd(sock, &listener, sizeof(listener), pool->listeners[i].fd);
+    }
+    for (conn_t* conn = pool->conn_head; conn != NULL && result == 0; conn = conn->next)
+        result = sendConn(sock, conn, pool);
+    if (result != 0)
+    {
+        fprintf(stderr, "Handoff failed, the server keeps running\n");
+        close(sock);
+        return -1;
+    }
+
+    // The new server takes over the handoff path and the message log.
+    closeHandoffSocket(pool);
+    unlink(pool->config.handoff_path);
+    closeLog(pool->log);
+    pool->log = NULL;
+
+    header.magic = HANDOFF_DONE;
+    header.nr_listeners = 0;
+    header.nr_conns = 0;
+    result = sendWithFd(sock, &header, sizeof(header), -1);
+
+    // The clients stay ours until the new server is set up; it may still fail to listen
+    // or to open the log.
+    struct timeval timeout = { HANDOFF_READY_TIMEOUT_MS / 1000, (HANDOFF_READY_TIMEOUT_MS % 1000) * 1000 };
+    if (result == 0 && setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+    {
+        perror("setsockopt SO_RCVTIMEO failed");
+        result = -1;
+    }
+    if (result == 0 && (receiveWithFd(sock, &header, sizeof(header), NULL) != 0 || header.magic != HANDOFF_READY))
+        result = -1;
+    if (result == 0)
+    {
+        header.magic = HANDOFF_COMMIT;
+        result = sendWithFd(sock, &header, sizeof(header), -1);
+    }
+    close(sock);
+    if (result != 0)
+    {
+        // The new server went away before taking over; carry on, and wait for another one.
+        fprintf(stderr, "Handoff failed, the server keeps running\n");
+        if (pool->config.log_dir)
+            pool->log = openLog(pool->config.log_dir, pool->config.log_sync, pool->config.log_sync_param);
+        pool->handoff_socket = listenForHandoff(pool->config.handoff_path);
+        if (pool->handoff_socket != -1)
+        {
+            FD_SET(pool->handoff_socket, &pool->read_set);
+            updateMaxFd(pool);
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+int takeOverServer(const char* path, conn_pool_t* pool)
+{
+    struct sockaddr_un addr;
+    if (handoffAddress(path, &addr) != 0)
+        return -1;
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0)
+    {
+        perror("Error creating handoff socket");
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        perror("Cannot connect to the running server");
+        close(sock);
+        return -1;
+    }
+
+    handoff_header_t header;
+    if (receiveWithFd(sock, &header, sizeof(header), NULL) != 0 || header.magic != HANDOFF_MAGIC ||
+        header.nr_listeners == 0 || header.nr_listeners > MAX_LISTENERS)
+        goto failed;
+
+    for (uint32_t i = 0; i < header.nr_listeners; i++)
+    {
+        handoff_listener_t listener;
+        int fd = -1;
+        if (receiveWithFd(sock, &listener, sizeof(listener), &fd) != 0 || fd < 0)
+            goto failed;
+        listener.path[sizeof(listener.path) - 1] = '\0';
+        registerListener(pool, fd, listener.family, listener.type, listener.shm, listener.path[0] != '\0' ? listener.path : NULL);
+    }
+
+    for (uint32_t i = 0; i < header.nr_conns; i++)
+        if (receiveConn(sock, pool) != 0)
+            goto failed;
+
+    // Wait until the old server has let go of the message log.
+    if (receiveWithFd(sock, &header, sizeof(header), NULL) != 0 || header.magic != HANDOFF_DONE)
+        goto failed;
+
+    return sock;
+
+failed:
+    fprintf(stderr, "Takeover failed\n");
+    close(sock);
+    closeListeners(pool, 0); // The sockets still belong to the running server
+    return -1;
+}
+
+int completeTakeover(int sock, conn_pool_t* pool)
+{
+    handoff_header_t header = { HANDOFF_READY, 0, 0 };
+    int result = sendWithFd(sock, &header, sizeof(header), -1);
+
+    // The old server answers at once, or closes the connection if it gave up waiting.
+    if (result == 0 && (receiveWithFd(sock, &header, sizeof(header), NULL) != 0 || header.magic != HANDOFF_COMMIT))
+        result = -1;
+    close(sock);
+    if (result != 0)
+    {
+        fprintf(stderr, "Takeover failed, the old server keeps running\n");
+        return -1;
+    }
+
+    PRINT_INFO(pool, "Took over %u connections\n", pool->nr_conns);
+    return 0;
+}
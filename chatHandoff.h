@@ -0,0 +1,141 @@
+#ifndef CHAT_HANDOFF_H
+#define CHAT_HANDOFF_H
+
+#include "chatServer.h"
+
+/*
+ * Hot restart. A server started with a handoff path listens on a Unix socket at that
+ * path. A new server started with the same path as its takeover path connects to it,
+ * and the running server hands over its listening sockets and every client connection
+ * (descriptors are passed with SCM_RIGHTS) together with the state needed to carry on:
+ * room, nickname, protocol, unprocessed input and queued output. The old server then
+ * exits without closing anything the clients can notice, so an upgrade causes no
+ * reconnects.
+ *
+ * The handoff uses a SOCK_SEQPACKET socket so that every message, and the descriptor
+ * attached to it, arrives on its own:
+ *   1. handoff_header_t with the number of listeners and connections.
+ *   2. For each listener, handoff_listener_t with the listening socket attached.
+ *   3. For each connection, handoff_conn_t with the client socket attached, the memfd
+ *      and the eventfd of its shared-memory ring in one message each if it has one, and
+ *      its input and output bytes in messages of up to HANDOFF_CHUNK_SIZE bytes. The
+ *      output held for a connection whose protocol is unknown goes over as frames.
+ *   4. handoff_header_t with magic HANDOFF_DONE once the old server has closed its
+ *      message log, so that the new server can open it.
+ *   5. From the new server, handoff_header_t with magic HANDOFF_READY once it has
+ *      opened the message log and restored the histories.
+ *   6. handoff_header_t with magic HANDOFF_COMMIT, after which the old server exits.
+ * Until the commit the clients are still the old server's. If the new server fails to
+ * set up or does not get ready within HANDOFF_READY_TIMEOUT_MS, the old server reopens
+ * the log, serves on and listens for a successor again, and the new server, which gets
+ * no commit, exits. The new server only listens for its own successor after the commit.
+ */
+
+#define HANDOFF_MAGIC 0x464F4843u /* "CHOF" */
+#define HANDOFF_DONE 0x454E4F44u /* "DONE" */
+#define HANDOFF_READY 0x59444552u /* "REDY" */
+#define HANDOFF_COMMIT 0x54494D43u /* "CMIT" */
+/* Time the old server waits for the new one to be ready before it takes the clients back. */
+#define HANDOFF_READY_TIMEOUT_MS 5000
+#define HANDOFF_CHUNK_SIZE 65536
+
+typedef struct handoff_header {
+    uint32_t magic;
+    /* Number of listeners that follow. */
+    uint32_t nr_listeners;
+    /* Number of connections that follow the listeners. */
+    uint32_t nr_conns;
+}handoff_header_t;
+
+typedef struct handoff_listener {
+    /* Address family and type of the listening socket. */
+    int32_t family;
+    int32_t type;
+    /* Non-zero for a shm listener. */
+    int32_t shm;
+    /* Path of a Unix socket, or an empty string. */
+    char path[UNIX_PATH_SIZE];
+}handoff_listener_t;
+
+typedef struct handoff_conn {
+    /* Protocol spoken by the connection (PROTO_*). */
+    int32_t protocol;
+    /* Non-zero for a SOCK_SEQPACKET socket. */
+    int32_t seqpacket;
+    /* Non-zero if the descriptors of a shared-memory ring follow. */
+    int32_t ring;
+    /* Non-zero if SO_ZEROCOPY is enabled on the socket. */
+    int32_t zerocopy;
+    /* Sequence number the kernel will assign to the next zero-copy send. */
+    uint32_t zc_next_seq;
+    /* Non-zero if zero-copy sends made by the old server have not completed yet. */
+    uint32_t zc_pending;
+    /* Number of unprocessed input bytes that follow. */
+    uint32_t read_len;
+    /* Number of queued output bytes that follow the input (held frames if the protocol is unknown). */
+    uint32_t write_len;
+    /* Name of the connection's room. */
+    char room[ROOM_NAME_SIZE];
+    /* Registered nickname, or an empty string. */
+    char nick[NICK_SIZE];
+}handoff_conn_t;
+
+/**
+ * Creates the Unix socket a running server listens on for a successor, replacing a
+ * stale socket file left at the path.
+ *
+ * @param path: The path of the socket.
+ * @return: The listening socket, or -1 on failure.
+ */
+int listenForHandoff(const char* path);
+
+/**
+ * Stops listening for a successor: removes the handoff socket from the read set and
+ * closes it. Does nothing if the pool has no handoff socket.
+ *
+ * @param pool: A pointer to the conn_pool_t structure owning the handoff socket.
+ */
+void closeHandoffSocket(conn_pool_t* pool);
+
+/**
+ * Hands the server over to a successor that connected to the handoff socket: accepts
+ * the connection, sends the listening sockets and all client connections with their
+ * state, closes the message log and signals the successor that it may proceed, then
+ * waits for the successor to be ready and commits the handoff. The pool's connections
+ * are left in place; the caller should exit without draining them. If the handoff
+ * fails, the message log is reopened and the server listens for a successor again.
+ *
+ * @param pool: A pointer to the conn_pool_t structure with the listeners and connections to hand over.
+ * @return
+ *   - 0 if the successor took over the server.
+ *   - -1 if the handoff failed; the server keeps running.
+ */
+int handOffServer(conn_pool_t* pool);
+
+/**
+ * Takes over a running server listening for a successor at the given path. The
+ * listening sockets received become the pool's listeners, and the connections are added to the pool in their rooms with their nicknames,
+ * unprocessed input and queued output. Returns once the old server has closed its
+ * message log; the clients may only be served after completeTakeover.
+ *
+ * @param path: The path of the old server's handoff socket.
+ * @param pool: A pointer to an initialized conn_pool_t structure receiving the connections.
+ * @return
+ *   - The connection to the old server, to pass to completeTakeover.
+ *   - -1 on failure.
+ */
+int takeOverServer(const char* path, conn_pool_t* pool);
+
+/**
+ * Tells the old server that this server is set up and waits for it to commit the
+ * handoff. Closes the connection to the old server.
+ *
+ * @param sock: The connection returned by takeOverServer.
+ * @param pool: A pointer to the conn_pool_t structure that took over the connections.
+ * @return
+ *   - 0 if the clients are now this server's.
+ *   - -1 if the old server kept them; this server must exit without touching them.
+ */
+int completeTakeover(int sock, conn_pool_t* pool);
+
+#endif
@@ -0,0 +1,843 @@
+#include "chatLog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void initCrcTable(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+        crc_table[i] = crc;
+    }
+}
+
+/*
+ * CRC-32 (IEEE) of a buffer.
+ */
+static uint32_t logChecksum(const char* data, size_t len)
+{
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++)
+        crc = crc_table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+/*
+ * Returns the number of bytes the checksum of a record covers.
+ */
+static size_t checksumLength(const log_record_header_t* header)
+{
+    return sizeof(log_record_header_t) - offsetof(log_record_header_t, offset) + header->room_len + header->body_len;
+}
+
+/*
+ * Builds the path of a segment file (suffix ".log") or its index file (suffix ".idx").
+ */
+static void segmentPath(const chat_log_t* log, uint64_t base_offset, const char* suffix, char* path, size_t size)
+{
+    snprintf(path, size, "%s/%020llu%s", log->dir, (unsigned long long)base_offset, suffix);
+}
+
+int parseLogSync(const char* spec, int* policy, int* param)
+{
+    if (strcmp(spec, "none") == 0)
+    {
+        *policy = LOG_SYNC_NONE;
+        *param = 0;
+        return 0;
+    }
+    if (sscanf(spec, "interval:%d", param) == 1 && *param > 0)
+    {
+        *policy = LOG_SYNC_INTERVAL;
+        return 0;
+    }
+    if (sscanf(spec, "every:%d", param) == 1 && *param > 0)
+    {
+        *policy = LOG_SYNC_EVERY;
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Maps an index file into a segment. With create set the file is created empty,
+ * otherwise an existing file is mapped and its header checked.
+ *
+ * Returns -1 if the file cannot be mapped or does not belong to the segment.
+ */
+static int mapIndexFile(const chat_log_t* log, log_segment_t* segment, int create)
+{
+    char path[PATH_MAX];
+    segmentPath(log, segment->base_offset, ".idx", path, sizeof(path));
+
+    size_t size = sizeof(log_index_header_t) + LOG_INDEX_CAPACITY * sizeof(log_index_entry_t);
+    int fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        if (create || errno != ENOENT)
+            perror("open failed");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (create && ftruncate(fd, size) < 0)
+    {
+        perror("ftruncate failed");
+        close(fd);
+        return -1;
+    }
+    if (!create)
+    {
+        if ((size_t)st.st_size < sizeof(log_index_header_t))
+        {
+            close(fd);
+            return -1;
+        }
+        size = st.st_size;
+    }
+
+    // The file is sparse; only the pages holding entries take up space.
+    char* map = (char*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // The mapping stays valid.
+    if (map == MAP_FAILED)
+    {
+        perror("mmap failed");
+        return -1;
+    }
+
+    log_index_header_t* header = (log_index_header_t*) map;
+    if (create)
+    {
+        header->magic = LOG_INDEX_MAGIC;
+        header->base_offset = segment->base_offset;
+    }
+    else if (header->magic != LOG_INDEX_MAGIC || header->base_offset != segment->base_offset)
+    {
+        munmap(map, size);
+        return -1;
+    }
+
+    segment->index_header = header;
+    segment->index_size = size;
+    segment->index = (log_index_entry_t*)(map + sizeof(log_index_header_t));
+    segment->index_capacity = (unsigned int)((size - sizeof(log_index_header_t)) / sizeof(log_index_entry_t));
+    segment->nr_index = 0;
+    return 0;
+}
+
+static void unmapIndexFile(log_segment_t* segment)
+{
+    if (segment->index_header)
+        munmap(segment->index_header, segment->index_size);
+    segment->index_header = NULL;
+    segment->index = NULL;
+    segment->nr_index = segment->index_capacity = 0;
+}
+
+/*
+ * Records the end of a complete segment in its index file. The seal is written after
+ * the rest of the header, and with sync set, made durable.
+ */
+static void sealIndex(log_index_header_t* header, uint64_t end_offset, size_t used, unsigned int nr_index, int sync)
+{
+    if (!header)
+        return;
+
+    header->end_offset = end_offset;
+    header->used = used;
+    header->nr_entries = nr_index;
+    header->sealed = 1;
+    if (sync)
+        msync(header, sizeof(log_index_header_t) + nr_index * sizeof(log_index_entry_t), MS_SYNC);
+}
+
+/*
+ * Takes the end of a segment from its sealed index.
+ *
+ * Returns -1 if the index is not sealed or inconsistent.
+ */
+static int loadSealedIndex(log_segment_t* segment)
+{
+    const log_index_header_t* header = segment->index_header;
+    if (!header->sealed || header->nr_entries > segment->index_capacity || header->end_offset < header->base_offset)
+        return -1;
+
+    segment->end_offset = header->end_offset;
+    segment->used = header->used;
+    segment->nr_index = header->nr_entries;
+    return 0;
+}
+
+/*
+ * Indexes the record starting at the given position if the last index entry is at
+ * least LOG_INDEX_BYTES behind it.
+ */
+static void indexRecord(log_segment_t* segment, uint64_t offset, size_t position)
+{
+    if (segment->nr_index == segment->index_capacity)
+        return; // The index only gets sparser.
+
+    if (segment->nr_index == 0 || position - segment->index[segment->nr_index - 1].position >= LOG_INDEX_BYTES)
+    {
+        segment->index[segment->nr_index].offset = offset;
+        segment->index[segment->nr_index].position = position;
+        segment->nr_index++;
+    }
+}
+
+/*
+ * Walks the records of a mapped segment, building its index and setting its end.
+ *
+ * Returns -1 if the walk stopped at an invalid record rather than at the end marker.
+ */
+static int scanSegment(log_segment_t* segment, const char* map, size_t size)
+{
+    size_t position = 0;
+    uint64_t offset = segment->base_offset;
+    int result = 0;
+
+    while (position + sizeof(log_record_header_t) <= size)
+    {
+        const log_record_header_t* header = (const log_record_header_t*)(map + position);
+        if (header->length == 0)
+            break; // End of the records.
+
+        if (header->length % LOG_RECORD_ALIGN != 0 || header->length > size - position ||
+            header->offset != offset ||
+            sizeof(log_record_header_t) + header->room_len + header->body_len > header->length ||
+            logChecksum((const char*)&header->offset, checksumLength(header)) != header->checksum)
+        {
+            result = -1; // Torn or corrupt record.
+            break;
+        }
+
+        indexRecord(segment, offset, position);
+        position += header->length;
+        offset++;
+    }
+
+    segment->used = position;
+    segment->end_offset = offset;
+    return result;
+}
+
+/*
+ * Creates a segment file, allocates its blocks on disk and maps it for writing. Fails,
+ * leaving no file behind, if the disk has no room for the whole segment.
+ */
+static int createSegmentFile(const chat_log_t* log, uint64_t base_offset, int* fd, char** map)
+{
+    char path[PATH_MAX];
+    segmentPath(log, base_offset, ".log", path, sizeof(path));
+
+    *fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (*fd < 0)
+    {
+        perror("open failed");
+        return -1;
+    }
+    // Allocate the blocks now: a store to a hole of a sparse file raises SIGBUS when the disk is full.
+    int error = posix_fallocate(*fd, 0, LOG_SEGMENT_SIZE);
+    if (error != 0)
+    {
+        fprintf(stderr, "Failed to allocate log segment %s: %s\n", path, strerror(error));
+        close(*fd);
+        unlink(path);
+        return -1;
+    }
+    *map = (char*) mmap(NULL, LOG_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (*map == MAP_FAILED)
+    {
+        perror("mmap failed");
+        close(*fd);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Adds a segment with the given base offset at the end of the segment list.
+ */
+static log_segment_t* addSegment(chat_log_t* log, uint64_t base_offset)
+{
+    if (log->nr_segments == log->segments_capacity)
+    {
+        unsigned int capacity = log->segments_capacity ? log->segments_capacity * 2 : 16;
+        log_segment_t* segments = (log_segment_t*) realloc(log->segments, capacity * sizeof(log_segment_t));
+        if (!segments)
+        {
+            fprintf(stderr, "malloc failed\n");
+            return NULL;
+        }
+        log->segments = segments;
+        log->segments_capacity = capacity;
+    }
+
+    log_segment_t* segment = &log->segments[log->nr_segments++];
+    memset(segment, 0, sizeof(*segment));
+    segment->base_offset = segment->end_offset = base_offset;
+    return segment;
+}
+
+static int compareSegments(const void* a, const void* b)
+{
+    uint64_t x = ((const log_segment_t*)a)->base_offset;
+    uint64_t y = ((const log_segment_t*)b)->base_offset;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Maps the records of a segment that is not the tail for reading. Segments are only
+ * mapped while they are read, and their pages are read in as the read reaches them.
+ */
+static char* mapSegment(const chat_log_t* log, const log_segment_t* segment)
+{
+    char path[PATH_MAX];
+    segmentPath(log, segment->base_offset, ".log", path, sizeof(path));
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror("open failed");
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size < segment->used)
+    {
+        fprintf(stderr, "Log segment %s is shorter than its index\n", path);
+        close(fd);
+        return NULL;
+    }
+    char* map = (char*) mmap(NULL, segment->used, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping stays valid.
+    if (map == MAP_FAILED)
+    {
+        perror("mmap failed");
+        return NULL;
+    }
+    madvise(map, segment->used, MADV_SEQUENTIAL);
+    return map;
+}
+
+/*
+ * Loads a segment that is not the tail. Only its index file is mapped, unless the index
+ * is missing or was never sealed; then the segment is scanned to rebuild it.
+ */
+static int loadSegment(const chat_log_t* log, log_segment_t* segment)
+{
+    if (mapIndexFile(log, segment, 0) == 0)
+    {
+        if (loadSealedIndex(segment) == 0)
+            return 0;
+        unmapIndexFile(segment);
+    }
+    if (mapIndexFile(log, segment, 1) != 0)
+        return -1;
+
+    char path[PATH_MAX];
+    segmentPath(log, segment->base_offset, ".log", path, sizeof(path));
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror("open failed");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        sealIndex(segment->index_header, segment->end_offset, 0, 0, 1);
+        return 0;
+    }
+
+    char* map = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap failed");
+        return -1;
+    }
+    if (scanSegment(segment, map, st.st_size) != 0)
+        fprintf(stderr, "Log segment %s is damaged after offset %llu\n", path, (unsigned long long)segment->end_offset);
+    munmap(map, st.st_size);
+    sealIndex(segment->index_header, segment->end_offset, segment->used, segment->nr_index, 1);
+    return 0;
+}
+
+/*
+ * Maps the last segment of the log for appending and finds its end.
+ */
+static int loadTailSegment(chat_log_t* log, log_segment_t* segment)
+{
+    char path[PATH_MAX];
+    segmentPath(log, segment->base_offset, ".log", path, sizeof(path));
+
+    struct stat st;
+    log->fd = open(path, O_RDWR);
+    if (log->fd < 0 || fstat(log->fd, &st) < 0)
+    {
+        perror("open failed");
+        return -1;
+    }
+
+    // Closed segments are truncated to their records; grow the tail back for appending,
+    // with its blocks allocated as for a new segment.
+    log->map_size = (size_t)st.st_size > LOG_SEGMENT_SIZE ? (size_t)st.st_size : LOG_SEGMENT_SIZE;
+    int error = posix_fallocate(log->fd, 0, log->map_size);
+    if (error != 0)
+    {
+        fprintf(stderr, "Failed to allocate log segment %s: %s\n", path, strerror(error));
+        return -1;
+    }
+    log->map = (char*) mmap(NULL, log->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0);
+    if (log->map == MAP_FAILED)
+    {
+        perror("mmap failed");
+        log->map = NULL;
+        return -1;
+    }
+
+    // A tail closed cleanly has a sealed index; unseal it durably before appending, so
+    // that a crash makes the next start scan the segment.
+    if (mapIndexFile(log, segment, 0) == 0)
+    {
+        if (loadSealedIndex(segment) == 0 && segment->used <= log->map_size)
+        {
+            segment->index_header->sealed = 0;
+            msync(segment->index_header, sizeof(log_index_header_t), MS_SYNC);
+            return 0;
+        }
+        unmapIndexFile(segment);
+    }
+    if (mapIndexFile(log, segment, 1) != 0)
+        return -1;
+
+    if (scanSegment(segment, log->map, log->map_size) != 0)
+    {
+        // Records after a torn one may have reached the disk out of order; clear them so
+        // they cannot be mistaken for records appended later.
+        fprintf(stderr, "Log segment %s is damaged after offset %llu\n", path, (unsigned long long)segment->end_offset);
+        memset(log->map + segment->used, 0, log->map_size - segment->used);
+    }
+    return 0;
+}
+
+/*
+ * Flusher thread: syncs the appended part of the tail segment according to the sync
+ * policy, and syncs, unmaps and closes rolled over segments.
+ */
+static void* flushLog(void* arg)
+{
+    chat_log_t* log = (chat_log_t*) arg;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    pthread_mutex_lock(&log->lock);
+    for (;;)
+    {
+        if (!log->retired && !log->stopping)
+        {
+            if (log->sync_policy == LOG_SYNC_INTERVAL)
+            {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += log->sync_param / 1000;
+                deadline.tv_nsec += (long)(log->sync_param % 1000) * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L)
+                {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&log->cond, &log->lock, &deadline);
+            }
+            else
+            {
+                while (!log->retired && !log->stopping && log->unsynced < (unsigned int)log->sync_param)
+                    pthread_cond_wait(&log->cond, &log->lock);
+            }
+        }
+
+        // Take the pending work and sync it without holding the lock, so appends go on.
+        log_retired_t* retired = log->retired;
+        log->retired = NULL;
+        char* map = log->map;
+        size_t from = log->synced & ~(page - 1);
+        size_t to = log->published;
+        log->unsynced = 0;
+        int stopping = log->stopping;
+        pthread_mutex_unlock(&log->lock);
+
+        while (retired != NULL)
+        {
+            log_retired_t* next = retired->next;
+            msync(retired->map, retired->used, MS_SYNC);
+            munmap(retired->map, retired->size);
+            if (ftruncate(retired->fd, retired->used) < 0)
+                perror("ftruncate failed");
+            close(retired->fd);
+            // The records are on disk, so the index may now vouch for them.
+            sealIndex(retired->index_header, retired->end_offset, retired->used, retired->nr_index, 1);
+            free(retired);
+            retired = next;
+        }
+        if (to > from)
+            msync(map + from, to - from, MS_SYNC);
+
+        pthread_mutex_lock(&log->lock);
+        if (log->map == map && log->synced < to)
+            log->synced = to;
+        if (stopping)
+            break;
+    }
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+chat_log_t* openLog(const char* dir, int sync_policy, int sync_param)
+{
+    pthread_once(&crc_table_once, initCrcTable);
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        perror("mkdir failed");
+        return NULL;
+    }
+    DIR* dp = opendir(dir);
+    if (!dp)
+    {
+        perror("opendir failed");
+        return NULL;
+    }
+
+    chat_log_t* log = (chat_log_t*) calloc(1, sizeof(chat_log_t));
+    if (!log || !(log->dir = strdup(dir)))
+    {
+        fprintf(stderr, "malloc failed\n");
+        free(log);
+        closedir(dp);
+        return NULL;
+    }
+    log->fd = -1;
+    log->sync_policy = sync_policy;
+    log->sync_param = sync_param;
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->cond, NULL);
+
+    // Collect the segment files; their names are the base offsets.
+    struct dirent* entry;
+    while ((entry = readdir(dp)) != NULL)
+    {
+        unsigned long long base_offset;
+        int name_len = 0;
+        if (sscanf(entry->d_name, "%20llu.log%n", &base_offset, &name_len) == 1 &&
+            name_len == 24 && entry->d_name[24] == '\0' && !addSegment(log, base_offset))
+        {
+            closedir(dp);
+            closeLog(log);
+            return NULL;
+        }
+    }
+    closedir(dp);
+    if (log->nr_segments > 1)
+        qsort(log->segments, log->nr_segments, sizeof(log_segment_t), compareSegments);
+
+    int result = 0;
+    for (unsigned int i = 0; i + 1 < log->nr_segments && result == 0; i++)
+        result = loadSegment(log, &log->segments[i]);
+
+    if (result == 0 && log->nr_segments > 0)
+        result = loadTailSegment(log, &log->segments[log->nr_segments - 1]);
+    else if (result == 0)
+    {
+        // A new log starts with an empty segment at offset 0.
+        int fd;
+        char* map;
+        log_segment_t* segment = addSegment(log, 0);
+        result = segment ? createSegmentFile(log, 0, &fd, &map) : -1;
+        if (result == 0)
+            mapIndexFile(log, segment, 1); // The segment still works without an index.
+        if (result == 0)
+        {
+            log->fd = fd;
+            log->map = map;
+            log->map_size = LOG_SEGMENT_SIZE;
+        }
+    }
+
+    if (result != 0)
+    {
+        closeLog(log);
+        return NULL;
+    }
+    log->published = log->synced = log->segments[log->nr_segments - 1].used;
+
+    if (sync_policy != LOG_SYNC_NONE)
+    {
+        if (pthread_create(&log->flusher, NULL, flushLog, log) != 0)
+        {
+            fprintf(stderr, "Failed to start the log flusher thread\n");
+            closeLog(log);
+            return NULL;
+        }
+        log->has_flusher = 1;
+    }
+
+    return log;
+}
+
+/*
+ * Starts a new tail segment after the current one. The old segment is handed to the
+ * flusher thread, or closed right away if there is none. If the new segment cannot be
+ * created, the old one stays the tail.
+ */
+static int rollSegment(chat_log_t* log)
+{
+    log_retired_t* retired = (log_retired_t*) malloc(sizeof(log_retired_t));
+    if (!retired)
+    {
+        fprintf(stderr, "malloc failed\n");
+        return -1;
+    }
+
+    // Remember what the flusher needs of the old tail; adding a segment moves the array.
+    const log_segment_t* tail = &log->segments[log->nr_segments - 1];
+    retired->fd = log->fd;
+    retired->map = log->map;
+    retired->size = log->map_size;
+    retired->used = tail->used;
+    retired->index_header = tail->index_header;
+    retired->end_offset = tail->end_offset;
+    retired->nr_index = tail->nr_index;
+
+    int fd;
+    char* map;
+    log_segment_t* segment = addSegment(log, retired->end_offset);
+    if (!segment)
+    {
+        free(retired);
+        return -1;
+    }
+    if (createSegmentFile(log, segment->base_offset, &fd, &map) != 0)
+    {
+        log->nr_segments--;
+        free(retired);
+        return -1;
+    }
+    mapIndexFile(log, segment, 1); // The segment still works without an index.
+
+    if (log->has_flusher)
+        pthread_mutex_lock(&log->lock);
+    log->fd = fd;
+    log->map = map;
+    log->map_size = LOG_SEGMENT_SIZE;
+    log->published = log->synced = 0;
+    if (log->has_flusher)
+    {
+        retired->next = log->retired;
+        log->retired = retired;
+        pthread_cond_signal(&log->cond);
+        pthread_mutex_unlock(&log->lock);
+        return 0;
+    }
+
+    munmap(retired->map, retired->size);
+    if (ftruncate(retired->fd, retired->used) < 0)
+        perror("ftruncate failed");
+    close(retired->fd);
+    sealIndex(retired->index_header, retired->end_offset, retired->used, retired->nr_index, 0);
+    free(retired);
+    return 0;
+}
+
+/*
+ * Returns the current time of the monotonic clock in milliseconds.
+ */
+static uint64_t monotonicMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+int appendToLog(chat_log_t* log, const char* room, const char* body, int len)
+{
+    size_t room_len = strlen(room);
+    size_t length = sizeof(log_record_header_t) + room_len + (size_t)len;
+    length = (length + LOG_RECORD_ALIGN - 1) & ~(size_t)(LOG_RECORD_ALIGN - 1);
+    if (len < 0 || room_len > UINT16_MAX || length > LOG_SEGMENT_SIZE)
+        return -1;
+
+    log_segment_t* tail = &log->segments[log->nr_segments - 1];
+    if (tail->used + length > log->map_size)
+    {
+        // After a failed roll the records are dropped without touching the disk until
+        // the retry is due, each failure doubling the wait.
+        if (log->roll_backoff_ms != 0 && monotonicMs() < log->roll_retry_at)
+            return -1;
+        if (rollSegment(log) != 0)
+        {
+            log->roll_backoff_ms = log->roll_backoff_ms ? log->roll_backoff_ms * 2 : LOG_ROLL_RETRY_MS;
+            if (log->roll_backoff_ms > LOG_ROLL_RETRY_MAX_MS)
+                log->roll_backoff_ms = LOG_ROLL_RETRY_MAX_MS;
+            log->roll_retry_at = monotonicMs() + log->roll_backoff_ms;
+            fprintf(stderr, "Log records are dropped for %u ms\n", log->roll_backoff_ms);
+            return -1;
+        }
+        log->roll_backoff_ms = 0;
+        tail = &log->segments[log->nr_segments - 1];
+    }
+
+    // The space after the last record is zeroed, so the padding needs no clearing.
+    char* record = log->map + tail->used;
+    log_record_header_t* header = (log_record_header_t*) record;
+    header->offset = tail->end_offset;
+    header->room_len = (uint16_t)room_len;
+    header->reserved = 0;
+    header->body_len = (uint32_t)len;
+    memcpy(record + sizeof(log_record_header_t), room, room_len);
+    memcpy(record + sizeof(log_record_header_t) + room_len, body, len);
+    header->checksum = logChecksum((const char*)&header->offset, checksumLength(header));
+    header->length = (uint32_t)length;
+
+    indexRecord(tail, tail->end_offset, tail->used);
+    tail->used += length;
+    tail->end_offset++;
+
+    if (log->has_flusher)
+    {
+        pthread_mutex_lock(&log->lock);
+        log->published = tail->used;
+        if (++log->unsynced >= (unsigned int)log->sync_param && log->sync_policy == LOG_SYNC_EVERY)
+            pthread_cond_signal(&log->cond);
+        pthread_mutex_unlock(&log->lock);
+    }
+
+    return 0;
+}
+
+int readLog(chat_log_t* log, uint64_t offset, log_visitor_t visit, void* arg)
+{
+    // Find the first segment with records at or after the offset.
+    unsigned int low = 0, high = log->nr_segments;
+    while (low < high)
+    {
+        unsigned int mid = (low + high) / 2;
+        if (log->segments[mid].end_offset <= offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    for (unsigned int i = low; i < log->nr_segments; i++)
+    {
+        const log_segment_t* segment = &log->segments[i];
+        if (segment->used == 0)
+            continue;
+
+        int is_tail = i == log->nr_segments - 1;
+        const char* map = is_tail ? log->map : mapSegment(log, segment);
+        if (!map)
+            return -1;
+
+        // Start from the last indexed record at or before the offset.
+        size_t position = 0;
+        unsigned int lo = 0, hi = segment->nr_index;
+        while (lo < hi)
+        {
+            unsigned int mid = (lo + hi) / 2;
+            if (segment->index[mid].offset <= offset)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo > 0)
+            position = segment->index[lo - 1].position;
+
+        int stop = 0;
+        while (position < segment->used && !stop)
+        {
+            const log_record_header_t* header = (const log_record_header_t*)(map + position);
+            if (header->length < sizeof(log_record_header_t) || header->length > segment->used - position)
+                break; // Only possible if the segment was damaged after its index was sealed.
+            if (header->offset >= offset)
+            {
+                log_record_t record;
+                record.offset = header->offset;
+                record.room = map + position + sizeof(log_record_header_t);
+                record.room_len = header->room_len;
+                record.body = record.room + header->room_len;
+                record.body_len = (int)header->body_len;
+                stop = visit(&record, arg);
+            }
+            position += header->length;
+        }
+
+        if (!is_tail)
+            munmap((void*)map, segment->used);
+        if (stop)
+            break;
+    }
+
+    return 0;
+}
+
+uint64_t logEndOffset(const chat_log_t* log)
+{
+    return log->segments[log->nr_segments - 1].end_offset;
+}
+
+void closeLog(chat_log_t* log)
+{
+    if (!log)
+        return;
+
+    if (log->has_flusher)
+    {
+        pthread_mutex_lock(&log->lock);
+        log->stopping = 1;
+        pthread_cond_signal(&log->cond);
+        pthread_mutex_unlock(&log->lock);
+        pthread_join(log->flusher, NULL);
+    }
+
+    // Sync the tail, seal its index so the next start need not scan it, and trim it to
+    // its records.
+    if (log->map)
+    {
+        const log_segment_t* tail = &log->segments[log->nr_segments - 1];
+        msync(log->map, tail->used, MS_SYNC);
+        sealIndex(tail->index_header, tail->end_offset, tail->used, tail->nr_index, 1);
+        munmap(log->map, log->map_size);
+        if (ftruncate(log->fd, tail->used) < 0)
+            perror("ftruncate failed");
+    }
+    if (log->fd >= 0)
+        close(log->fd);
+
+    for (unsigned int i = 0; i < log->nr_segments; i++)
+        unmapIndexFile(&log->segments[i]);
+    free(log->segments);
+    free(log->dir);
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->cond);
+    free(log);
+}
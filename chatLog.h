@@ -0,0 +1,261 @@
+#ifndef CHAT_LOG_H
+#define CHAT_LOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Append-only message log. Every broadcast message is appended to the log so that the
+ * room histories survive a restart. The log is a directory of segment files named after
+ * the offset (the sequence number) of their first record. The segment being appended to
+ * has its blocks allocated on disk when it is created or reopened (posix_fallocate, so a
+ * full disk fails that rather than a later store into the mapping) and is memory-mapped,
+ * so an append is a memcpy into the page cache; getting the pages to disk is left to
+ * the kernel or to a flusher thread, depending on the sync policy.
+ *
+ * Next to every segment file is an index file with the same name and an .idx suffix: a
+ * sparse array of (offset, position) entries, also written through a shared mapping.
+ * Once a segment is complete its index is sealed with the segment's end, so opening the
+ * log only maps the index files and never reads the segments themselves; a segment is
+ * only mapped when a read reaches it. Only a tail segment left behind by a crash has to
+ * be scanned.
+ */
+
+/* Size of the blocks allocated for a segment file; a new segment is started when a record does not fit. */
+#define LOG_SEGMENT_SIZE (64 * 1024 * 1024)
+/* The index of a segment gets an entry every this many bytes of records. */
+#define LOG_INDEX_BYTES 4096
+/* Wait before retrying to create a segment after a failure; it doubles up to the maximum on every further failure. */
+#define LOG_ROLL_RETRY_MS 1000
+#define LOG_ROLL_RETRY_MAX_MS 60000
+/* Number of entries an index file has room for. */
+#define LOG_INDEX_CAPACITY (LOG_SEGMENT_SIZE / LOG_INDEX_BYTES + 1)
+/* Identifies an index file ("CHIX"). */
+#define LOG_INDEX_MAGIC 0x58494843u
+/* Records start at multiples of this many bytes. */
+#define LOG_RECORD_ALIGN 8
+
+/* Sync policies. */
+/* Never sync explicitly; the kernel writes dirty pages back on its own schedule. */
+#define LOG_SYNC_NONE 0
+/* Sync whatever was appended every sync_param milliseconds. */
+#define LOG_SYNC_INTERVAL 1
+/* Sync once at least sync_param records were appended since the last sync. */
+#define LOG_SYNC_EVERY 2
+
+/*
+ * On-disk header of a log record. It is followed by the room name and the message body,
+ * and padded to LOG_RECORD_ALIGN bytes. A length of 0 marks the end of the records in a
+ * segment. Fields are stored in host byte order.
+ */
+typedef struct log_record_header {
+    /* Size of the whole record, including the header and the padding. */
+    uint32_t length;
+    /* CRC-32 of the record from the offset field to the end of the body. */
+    uint32_t checksum;
+    /* Offset of this record in the log. */
+    uint64_t offset;
+    /* Length of the room name. */
+    uint16_t room_len;
+    uint16_t reserved;
+    /* Length of the message body. */
+    uint32_t body_len;
+}log_record_header_t;
+
+/*
+ * A record handed to the callback of readLog. The pointers refer to the mapped
+ * segment and are only valid during the callback.
+ */
+typedef struct log_record {
+    uint64_t offset;
+    const char *room;
+    int room_len;
+    const char *body;
+    int body_len;
+}log_record_t;
+
+/*
+ * Callback invoked by readLog for every record. Returning non-zero stops the read.
+ */
+typedef int (*log_visitor_t)(const log_record_t* record, void* arg);
+
+/*
+ * Entry of a segment's sparse index: where the record with the given offset starts.
+ */
+typedef struct log_index_entry {
+    uint64_t offset;
+    uint64_t position;
+}log_index_entry_t;
+
+/*
+ * Header of an index file, followed by the index entries. Fields are stored in host
+ * byte order.
+ */
+typedef struct log_index_header {
+    /* LOG_INDEX_MAGIC. */
+    uint32_t magic;
+    /* Non-zero once the segment is complete and the fields below are valid. */
+    uint32_t sealed;
+    /* Offset of the first record in the segment. */
+    uint64_t base_offset;
+    /* Offset following the last record in the segment. */
+    uint64_t end_offset;
+    /* Number of bytes of records in the segment. */
+    uint64_t used;
+    /* Number of index entries. */
+    uint32_t nr_entries;
+    uint32_t reserved;
+}log_index_header_t;
+
+/*
+ * A segment file of the log.
+ */
+typedef struct log_segment {
+    /* Offset of the first record in the segment. */
+    uint64_t base_offset;
+    /* Offset following the last record in the segment. */
+    uint64_t end_offset;
+    /* Number of bytes of records in the segment. */
+    size_t used;
+    /* Shared mapping of the segment's index file, or NULL if it has none. */
+    log_index_header_t *index_header;
+    size_t index_size;
+    /* Sparse index of the segment, ordered by offset, inside the index file mapping. */
+    log_index_entry_t *index;
+    unsigned int nr_index;
+    unsigned int index_capacity;
+}log_segment_t;
+
+/*
+ * A segment that was rolled over and still has to be synced, unmapped and closed, and
+ * its index sealed, by the flusher thread.
+ */
+typedef struct log_retired {
+    struct log_retired *next;
+    int fd;
+    char *map;
+    /* Size of the mapping. */
+    size_t size;
+    /* Number of bytes of records in the segment. */
+    size_t used;
+    /* Index file of the segment and the values to seal it with. */
+    log_index_header_t *index_header;
+    uint64_t end_offset;
+    unsigned int nr_index;
+}log_retired_t;
+
+/*
+ * Data structure to keep track of an open log.
+ */
+typedef struct chat_log {
+    /* Directory holding the segment files. */
+    char *dir;
+    /* Segments ordered by offset; the last one is the tail being appended to. */
+    log_segment_t *segments;
+    unsigned int nr_segments;
+    unsigned int segments_capacity;
+    /* Descriptor, writable mapping and mapping size of the tail segment. */
+    int fd;
+    char *map;
+    size_t map_size;
+    /* Current wait after failing to create a segment, or 0, and when to try again (monotonic milliseconds). */
+    unsigned int roll_backoff_ms;
+    uint64_t roll_retry_at;
+    /* Sync policy (LOG_SYNC_*) and its interval or record count. */
+    int sync_policy;
+    int sync_param;
+
+    /* Flusher thread, running unless the policy is LOG_SYNC_NONE. */
+    pthread_t flusher;
+    int has_flusher;
+    /* Protects the fields below, which are shared with the flusher thread. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Number of bytes of the tail segment appended so far. */
+    size_t published;
+    /* Number of bytes of the tail segment synced so far. */
+    size_t synced;
+    /* Number of records appended since the last sync. */
+    unsigned int unsynced;
+    /* Rolled over segments waiting for the flusher. */
+    log_retired_t *retired;
+    /* Set when the log is closing. */
+    int stopping;
+}chat_log_t;
+
+/**
+ * Parses a sync policy given on the command line: "none", "interval:<ms>" or "every:<n>".
+ *
+ * @param spec: The NUL-terminated policy specification.
+ * @param policy: Receives the policy (LOG_SYNC_*).
+ * @param param: Receives the interval in milliseconds or the record count.
+ * @return
+ *   - 0 on success.
+ *   - -1 if the specification is invalid.
+ */
+int parseLogSync(const char* spec, int* policy, int* param);
+
+/**
+ * Opens the log stored in a directory, creating the directory if needed. The index
+ * files of the existing segments are mapped; segments without a sealed index, such as
+ * the tail after a crash, are scanned to rebuild it. A record with a bad checksum ends
+ * its segment, so a record torn by a crash is discarded. Unless the policy is
+ * LOG_SYNC_NONE, a flusher thread is started to sync appended records.
+ *
+ * @param dir: The directory holding the segment files.
+ * @param sync_policy: The sync policy (LOG_SYNC_*).
+ * @param sync_param: The sync interval in milliseconds or record count for the policy.
+ * @return: A pointer to the open log, or NULL on failure.
+ */
+chat_log_t* openLog(const char* dir, int sync_policy, int sync_param);
+
+/**
+ * Appends a message to the log. The record is copied into the mapped tail segment, so
+ * the call does no I/O, except when the record does not fit and a new segment is
+ * created. If that fails, e.g. because the disk is full, the record is not logged, and
+ * neither are the records appended before a retry, LOG_ROLL_RETRY_MS later at first and
+ * backing off to LOG_ROLL_RETRY_MAX_MS.
+ *
+ * @param log: A pointer to the open log.
+ * @param room: The NUL-terminated name of the room the message was broadcast in.
+ * @param body: The message body.
+ * @param len: The length of the message body in bytes.
+ * @return
+ *   - 0 on success.
+ *   - -1 if the record is too large or a new segment cannot be created.
+ */
+int appendToLog(chat_log_t* log, const char* room, const char* body, int len);
+
+/**
+ * Calls a visitor for every record of the log from a given offset on, in order. The
+ * segment holding the offset is found by its base offset and the record by the
+ * segment's sparse index, so the cost does not depend on how much of the log comes
+ * before the offset.
+ *
+ * @param log: A pointer to the open log.
+ * @param offset: The offset of the first record to visit.
+ * @param visit: The callback receiving the records.
+ * @param arg: Passed to the callback.
+ * @return
+ *   - 0 on success.
+ *   - -1 if a segment cannot be read.
+ */
+int readLog(chat_log_t* log, uint64_t offset, log_visitor_t visit, void* arg);
+
+/**
+ * Returns the offset the next appended record will get.
+ *
+ * @param log: A pointer to the open log.
+ */
+uint64_t logEndOffset(const chat_log_t* log);
+
+/**
+ * Stops the flusher thread, syncs and closes the log, seals the index of the tail
+ * segment and frees its resources.
+ *
+ * @param log: A pointer to the open log.
+ */
+void closeLog(chat_log_t* log);
+
+#endif
@@ -1,253 +1,1994 @@
 #include "chatServer.h"
+#include <stddef.h>
 
-void intHandler(int SIG_INT)
+/* Hello a client sends (and the server echoes) to switch to the binary framing protocol. */
+static const char frame_hello[FRAME_HELLO_SIZE] = FRAME_HELLO;
+
+void encodeFrameHeader(char* out, int type, int room, uint32_t length)
+{
+    uint16_t net_room = htons((uint16_t)room);
+    uint32_t net_length = htonl(length);
+
+    out[0] = (char)type;
+    out[1] = 0; // Flags, reserved.
+    memcpy(out + 2, &net_room, sizeof(net_room));
+    memcpy(out + 4, &net_length, sizeof(net_length));
+}
+
+void decodeFrameHeader(const char* in, frame_header_t* header)
+{
+    uint16_t net_room;
+    uint32_t net_length;
+    memcpy(&net_room, in + 2, sizeof(net_room));
+    memcpy(&net_length, in + 4, sizeof(net_length));
+
+    header->type = (uint8_t)in[0];
+    header->flags = (uint8_t)in[1];
+    header->room = ntohs(net_room);
+    header->length = ntohl(net_length);
+}
+
+/*
+ * Takes tokens for handled input from a rate limit bucket. Nothing is charged while the
+ * limit is off, so that no debt builds up for a limit a reload may switch on later.
+ */
+static void chargeBucket(token_bucket_t* bucket, int rate, long long amount)
 {
-    (void)SIG_INT; // Explicitly mark the parameter as unused
-    end_server = 1;
+    if (rate > 0)
+        bucket->tokens -= amount * BUCKET_TOKEN_UNIT;
 }
 
-int main(int argc, char* argv[])
+/*
+ * Formats a server notice and queues it on a single connection.
+ */
+static void sendNotice(conn_t* conn, conn_pool_t* pool, const char* format, ...)
 {
-    // Check command line arguments
-    if (argc != 2)
+    char notice[BUFFER_SIZE];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(notice, sizeof(notice), format, args);
+    va_end(args);
+
+    if (len >= (int)sizeof(notice))
+        len = (int)sizeof(notice) - 1;
+    if (len > 0)
+        deliverMessage(conn, FRAME_NOTICE, conn->room, notice, len, pool);
+}
+
+/*
+ * Moves a connection to the named room. Binary clients are answered with a JOIN
+ * frame carrying the room id, text clients with a notice.
+ */
+static void commandJoin(conn_t* conn, const char* name, conn_pool_t* pool)
+{
+    int room = findOrCreateRoom(pool, name);
+    int was_member = conn->room == room;
+    if (room < 0 || joinRoom(conn, room, pool) != 0)
     {
-        printf("Usage: server <port>\n");
-        exit(EXIT_FAILURE);
+        sendNotice(conn, pool, "* Cannot join room %s", name);
+        return;
     }
 
-    // Convert port number from string to integer, ensuring it's in a valid range
-    long temp_port = (long) strtoul(argv[1], NULL, 10);
-    if (temp_port < 1 || temp_port > 65535)
+    if (conn->protocol == PROTO_BINARY)
+        deliverMessage(conn, FRAME_JOIN, room, pool->rooms[room]->name, (int)strlen(pool->rooms[room]->name), pool);
+    else
+        sendNotice(conn, pool, "* Joined room %s", pool->rooms[room]->name);
+
+    // Catch the newcomer up on the conversation it missed.
+    if (!was_member)
+        replayHistory(conn, pool);
+}
+
+static void commandLeave(conn_t* conn, conn_pool_t* pool)
+{
+    if (conn->room == LOBBY_ROOM)
     {
-        printf( "Usage: server <port>\n");
-        exit(EXIT_FAILURE);
+        sendNotice(conn, pool, "* Already in the lobby");
+        return;
     }
 
-    in_port_t port = (in_port_t)temp_port;
+    joinRoom(conn, LOBBY_ROOM, pool);
+    if (conn->protocol == PROTO_BINARY)
+        deliverMessage(conn, FRAME_JOIN, LOBBY_ROOM, LOBBY_NAME, (int)strlen(LOBBY_NAME), pool);
+    else
+        sendNotice(conn, pool, "* Back in the lobby");
+    replayHistory(conn, pool);
+}
 
-    // Register signal handler for graceful shutdown
-    signal(SIGINT, intHandler);
+static void commandNick(conn_t* conn, const char* nick, conn_pool_t* pool)
+{
+    if (setNick(conn, nick, pool) != 0)
+    {
+        sendNotice(conn, pool, "* Nickname %s is not available", nick);
+        return;
+    }
+    sendNotice(conn, pool, "* You are now known as %s", conn->nick);
+}
 
-    // Initialize server and get the welcome socket
-    int welcome_socket = initializeServer(port);
-    if (welcome_socket == -1)
-        exit(EXIT_FAILURE); // Server initialization failed
+/*
+ * Queues a private message on the connection that registered the given nickname.
+ * Text recipients get a "[PM from <nick>] <text>" line; binary recipients get a
+ * PRIVMSG frame whose payload is the sender's nickname, a NUL byte and the text.
+ */
+static void commandPrivateMessage(conn_t* conn, const char* nick, const char* text, int len, conn_pool_t* pool)
+{
+    if (conn->nick[0] == '\0')
+    {
+        sendNotice(conn, pool, "* Set a nickname with /nick before sending private messages");
+        return;
+    }
 
-    // Initialize connection pool
-    conn_pool_t pool;
-    initPool(&pool);
+    conn_t* target = findConnByNick(pool, nick);
+    if (!target)
+    {
+        sendNotice(conn, pool, "* No such nickname %s", nick);
+        return;
+    }
 
-    // Add the listening socket to the set of file descriptors to monitor
-    FD_SET(welcome_socket, &pool.read_set);
-    pool.maxfd = welcome_socket; // Initially, the listening socket has the highest file descriptor number
+    int nick_len = (int)strlen(conn->nick);
+    char header[FRAME_HEADER_SIZE];
+    struct iovec iov[5];
+    if (target->protocol == PROTO_BINARY)
+    {
+        encodeFrameHeader(header, FRAME_PRIVMSG, target->room, (uint32_t)(nick_len + 1 + len));
+        iov[0] = (struct iovec){ header, FRAME_HEADER_SIZE };
+        iov[1] = (struct iovec){ conn->nick, nick_len + 1 };
+        iov[2] = (struct iovec){ (void*)text, len };
+        enqueueIov(target, iov, 3, pool);
+    }
+    else
+    {
+        iov[0] = (struct iovec){ "[PM from ", 9 };
+        iov[1] = (struct iovec){ conn->nick, nick_len };
+        iov[2] = (struct iovec){ "] ", 2 };
+        iov[3] = (struct iovec){ (void*)text, len };
+        iov[4] = (struct iovec){ "\n", 1 };
+        enqueueIov(target, iov, 5, pool);
+    }
+}
 
-    // Main server loop
-    do
+/*
+ * Handles a command line (a line starting with '/') received from a text connection.
+ */
+static void handleCommand(conn_t* conn, const char* line, int len, conn_pool_t* pool)
+{
+    char command[BUFFER_SIZE + 1 + TRANSFORM_MAX_GROWTH]; // The transforms may lengthen a private message
+    memcpy(command, line, len);
+
+    // Strip trailing spaces
+    while (len > 0 && command[len - 1] == ' ')
+        len--;
+    command[len] = '\0';
+    command[len + 1] = '\0'; // Empty message text that does not share the last word's terminator
+
+    char* save = NULL;
+    char* verb = strtok_r(command, " \t", &save);
+    char* arg = strtok_r(NULL, " \t", &save);
+
+    if (strcasecmp(verb, "/join") == 0 && arg != NULL)
+        commandJoin(conn, arg, pool);
+    else if (strcasecmp(verb, "/leave") == 0)
+        commandLeave(conn, pool);
+    else if (strcasecmp(verb, "/nick") == 0 && arg != NULL)
+        commandNick(conn, arg, pool);
+    else if (strcasecmp(verb, "/msg") == 0 && arg != NULL)
     {
-        // Copy file descriptor sets to avoid modifying the original sets
-        pool.ready_read_set = pool.read_set;
-        pool.ready_write_set = pool.write_set;
+        // The rest of the line after the nickname is the message text
+        char* text = save && *save != '\0' ? save + strspn(save, " \t") : command + len + 1;
+        transform_ctx_t ctx = { pool->timers.now_ms, &conn->rate_tag };
+        int text_len = (int)strlen(text);
+        int transformed_len = applyTransforms(&pool->config.transforms, text, text_len, &ctx);
+        if (transformed_len > 0 || text_len == 0) // Nothing is left to send of a text the transforms emptied
+            commandPrivateMessage(conn, arg, text, transformed_len, pool);
+    }
+    else
+        sendNotice(conn, pool, "* Unknown command %s", verb);
+}
 
-        // Block until input arrives at one or more active sockets
-        printf("Waiting on select()...\nMaxFd %d\n", pool.maxfd);
-        pool.nready = select(pool.maxfd + 1, &pool.ready_read_set, &pool.ready_write_set, NULL, NULL);
-        if (pool.nready < 0)
-            continue;
+/*
+ * Handles one complete line received from a connection: either a command or a chat
+ * message for the connection's room. The line terminator is not part of the message.
+ */
+static void handleLine(conn_t* conn, char* line, int len, conn_pool_t* pool)
+{
+    chargeBucket(&conn->msg_bucket, pool->config.rate_msgs, 1);
 
-        // Check each file descriptor in the set
-        for (int sd = 0; sd <= pool.maxfd && pool.nready > 0; sd++)
-        {
-            // Accept new connections
-            if (FD_ISSET(sd, &pool.ready_read_set))
-            {
-                if (sd == welcome_socket)
-                {
-                    if (acceptNewConnection(welcome_socket, &pool) != 0) // Accept the new connection and add it to the connections list
-                        continue;
-                }
+    if (len > 0 && line[len - 1] == '\n')
+        len--;
+    if (len > 0 && line[len - 1] == '\r')
+        len--;
 
-                else
-                {
-                    // Read data and add it to the clients' queues (or remove the client is disconnected)
-                    processDataFromConnection(sd, &pool, welcome_socket);
-                }
+    if (len > 0 && line[0] == '/')
+    {
+        handleCommand(conn, line, len, pool);
+        return;
+    }
 
-                pool.nready--;
-            }
+    // The line is transformed in place, unless a stage may lengthen it past the read buffer
+    char transformed[BUFFER_SIZE + TRANSFORM_MAX_GROWTH];
+    if (pool->config.transforms.growth > 0)
+    {
+        memcpy(transformed, line, len);
+        line = transformed;
+    }
+    transform_ctx_t ctx = { pool->timers.now_ms, &conn->rate_tag };
+    int transformed_len = applyTransforms(&pool->config.transforms, line, len, &ctx);
+    if (transformed_len == 0 && len > 0)
+        return; // The transforms left nothing of the message, e.g. one made only of control characters
+    addMsgToRoom(conn->fd, conn->room, line, transformed_len, pool);
+}
+
+/*
+ * Sets whether the connection has complete messages waiting in its read buffer, keeping
+ * count of the backlogged connections the main loop has to come back to.
+ */
+static void setBacklogged(conn_t* conn, int backlogged, conn_pool_t* pool)
+{
+    if (conn->backlogged == backlogged)
+        return;
+    conn->backlogged = backlogged;
+    if (!conn->read_paused)
+    {
+        if (backlogged)
+            pool->nr_backlogged++;
+        else
+            pool->nr_backlogged--;
+    }
+}
+
+/*
+ * Handles the complete lines in the connection's read buffer, up to the read budget,
+ * and keeps the rest for the next call.
+ */
+static void processLines(conn_t* conn, int* budget, conn_pool_t* pool)
+{
+    char* start = conn->read_buf;
+    char* end = conn->read_buf + conn->read_len;
+
+    while (*budget > 0)
+    {
+        int len = (int)(end - start);
+        char* newline = memchr(start, '\n', len < BUFFER_SIZE - 1 ? len : BUFFER_SIZE - 1);
+        if (newline)
+            len = (int)(newline - start + 1);
+        else if (len >= BUFFER_SIZE - 1)
+            len = BUFFER_SIZE - 1; // No line terminator within the default buffer; forward it as is
+        else
+            break;
+
+        handleLine(conn, start, len, pool);
+        start += len;
+        (*budget)--;
+    }
+
+    int remaining = (int)(end - start);
+    int backlogged = *budget == 0 && (remaining >= BUFFER_SIZE - 1 || memchr(start, '\n', remaining) != NULL);
+    setBacklogged(conn, backlogged, pool);
+    if (remaining > 0 && start != conn->read_buf)
+        memmove(conn->read_buf, start, remaining);
+
+    conn->read_len = remaining;
+}
+
+/*
+ * Copies a frame payload into a NUL-terminated name (room or nickname).
+ * Returns -1 if the payload does not fit or contains a NUL byte.
+ */
+static int framePayloadToName(const char* payload, uint32_t len, char* name, size_t size)
+{
+    if (len == 0 || len >= size || memchr(payload, '\0', len) != NULL)
+        return -1;
+
+    memcpy(name, payload, len);
+    name[len] = '\0';
+    return 0;
+}
+
+/*
+ * Handles one complete frame received from a binary connection. Message payloads
+ * are forwarded untouched.
+ *
+ * Returns -1 on a protocol error, after which the connection should be closed.
+ */
+static int handleFrame(conn_t* conn, const frame_header_t* header, char* payload, conn_pool_t* pool)
+{
+    char name[NICK_SIZE > ROOM_NAME_SIZE ? NICK_SIZE : ROOM_NAME_SIZE];
+
+    chargeBucket(&conn->msg_bucket, pool->config.rate_msgs, 1);
 
-            // Send queued messages to ready connections
-            if (FD_ISSET(sd, &pool.ready_write_set))
+    switch (header->type)
+    {
+        case FRAME_MSG:
+            if (header->room != conn->room)
             {
-                writeToClient(sd, &pool);
-                pool.nready--;
+                sendNotice(conn, pool, "* Not a member of room %u", header->room);
+                return 0;
             }
+            addMsgToRoom(conn->fd, conn->room, payload, (int)header->length, pool);
+            return 0;
+
+        case FRAME_JOIN:
+            if (framePayloadToName(payload, header->length, name, ROOM_NAME_SIZE) != 0)
+                return -1;
+            commandJoin(conn, name, pool);
+            return 0;
+
+        case FRAME_LEAVE:
+            commandLeave(conn, pool);
+            return 0;
+
+        case FRAME_NICK:
+            if (framePayloadToName(payload, header->length, name, NICK_SIZE) != 0)
+                return -1;
+            commandNick(conn, name, pool);
+            return 0;
+
+        case FRAME_PING:
+            deliverMessage(conn, FRAME_PONG, conn->room, payload, (int)header->length, pool);
+            return 0;
+
+        case FRAME_PONG:
+            return 0; // Receiving it is all that matters
+
+        case FRAME_PRIVMSG:
+        {
+            // The payload is the recipient's nickname, a NUL byte and the text
+            char* separator = memchr(payload, '\0', header->length);
+            if (!separator || framePayloadToName(payload, (uint32_t)(separator - payload), name, NICK_SIZE) != 0)
+                return -1;
+            commandPrivateMessage(conn, name, separator + 1, (int)(header->length - (separator + 1 - payload)), pool);
+            return 0;
         }
-    } while (!end_server);
 
+        default:
+            fprintf(stderr, "Unknown frame type %u on sd %d\n", header->type, conn->fd);
+            return -1;
+    }
+}
 
-    /* Cleanup connections on server shutdown */
-    conn_t* current = pool.conn_head;
-    while (current != NULL)
+/*
+ * Handles the complete frames in the connection's read buffer, up to the read budget,
+ * and keeps the rest.
+ *
+ * Returns -1 on a protocol error, after which the connection should be closed.
+ */
+static int processFrames(conn_t* conn, int* budget, conn_pool_t* pool)
+{
+    int offset = 0;
+    int backlogged = 0;
+    while (conn->read_len - offset >= FRAME_HEADER_SIZE)
     {
-        int current_fd = current->fd; // Store the current FD
-        conn_t* next = current->next; // Save the next connection
-        // Remove and cleanup the current connection
-        if (removeConn(current_fd, &pool) == 0)
-            printf("removing connection with sd %d \n", current_fd);
+        frame_header_t header;
+        decodeFrameHeader(conn->read_buf + offset, &header);
+        if (header.length > MAX_FRAME_PAYLOAD)
+            return -1;
+
+        int frame_size = FRAME_HEADER_SIZE + (int)header.length;
+        if (conn->read_len - offset < frame_size)
+            break; // Wait for the rest of the frame.
+        if (*budget == 0)
+        {
+            backlogged = 1; // Leave the frame for the next iteration.
+            break;
+        }
 
-        current = next; // Move to the next connection
+        if (handleFrame(conn, &header, conn->read_buf + offset + FRAME_HEADER_SIZE, pool) != 0)
+            return -1;
+        offset += frame_size;
+        (*budget)--;
     }
+    setBacklogged(conn, backlogged, pool);
+
+    int remaining = conn->read_len - offset;
+    if (remaining > 0 && offset > 0)
+        memmove(conn->read_buf, conn->read_buf + offset, remaining);
+    conn->read_len = remaining;
 
-    // Finally, close the listening socket
-    close(welcome_socket);
+    return 0;
 }
 
-void processDataFromConnection(int sd, conn_pool_t* pool, int welcome_socket)
+/*
+ * Settles the protocol of a new connection. A binary connection gets the hello echoed
+ * back, then the room's history is replayed, then the broadcasts held back while the
+ * protocol was unknown are released, re-encoded for the protocol.
+ *
+ * Returns -1 if the hello cannot be queued.
+ */
+static int startProtocol(conn_t* conn, int protocol, conn_pool_t* pool)
 {
-    char buffer[BUFFER_SIZE];
-    memset(buffer, 0, BUFFER_SIZE);
-    printf("Descriptor %d is readable\n", sd);
-    ssize_t bytes_read = read(sd, buffer, BUFFER_SIZE - 1);
-    if (bytes_read > 0)
+    // The held broadcasts go after the hello and the older history.
+    msg_t* held = conn->write_msg_head;
+    conn->write_msg_head = conn->write_msg_tail = NULL;
+    conn->queued_bytes = 0;
+    conn->protocol = protocol;
+
+    int result = protocol == PROTO_BINARY ? enqueueMessage(conn, frame_hello, FRAME_HELLO_SIZE, pool) : 0;
+    if (result == 0)
+        replayHistory(conn, pool);
+
+    while (held != NULL)
     {
-        printf("%zd bytes received from sd %d\n", bytes_read, sd);
-        capitalizeMessage(buffer, (int)bytes_read);
-        addMsg(sd, buffer, (int)bytes_read, pool);
+        msg_t* chunk = held;
+        held = chunk->next;
+        enqueuePayload(conn, chunk->payload, pool); // Held chunks all refer to a payload.
+        releaseChunk(pool, chunk);
     }
-    else if (bytes_read == 0)
+
+    return result;
+}
+
+/*
+ * Decides which protocol a new connection speaks from the first bytes it sends.
+ * A connection starting with the frame hello switches to the binary protocol and
+ * gets the hello echoed back; anything else is a text connection. Once the protocol
+ * is known, the lobby history is replayed to the connection.
+ *
+ * Returns -1 if the connection started a hello but sent something else.
+ */
+static int negotiateProtocol(conn_t* conn, conn_pool_t* pool)
+{
+    if (conn->read_buf[0] != frame_hello[0])
+        return startProtocol(conn, PROTO_TEXT, pool); // The lobby history can be encoded now.
+
+    int len = conn->read_len < FRAME_HELLO_SIZE ? conn->read_len : FRAME_HELLO_SIZE;
+    if (memcmp(conn->read_buf, frame_hello, len) != 0)
+        return -1;
+    if (len < FRAME_HELLO_SIZE)
+        return 0; // Wait for the rest of the hello.
+
+    conn->read_len -= FRAME_HELLO_SIZE;
+    memmove(conn->read_buf, conn->read_buf + FRAME_HELLO_SIZE, conn->read_len);
+
+    return startProtocol(conn, PROTO_BINARY, pool); // The lobby history follows the hello.
+}
+
+/*
+ * Handles the data accumulated in a connection's read buffer according to the
+ * connection's protocol, counting the messages handled against the budget.
+ *
+ * Returns -1 on a protocol error, after which the connection should be closed.
+ */
+static int processInput(conn_t* conn, int* budget, conn_pool_t* pool)
+{
+    if (conn->protocol == PROTO_UNKNOWN && negotiateProtocol(conn, pool) != 0)
+        return -1;
+
+    if (conn->protocol == PROTO_TEXT)
+        processLines(conn, budget, pool);
+    else if (conn->protocol == PROTO_BINARY)
+        return processFrames(conn, budget, pool);
+
+    return 0;
+}
+
+/*
+ * Returns non-zero if a connection has sent nothing for PROTOCOL_WAIT_MS, so that it is
+ * taken for a text client that only listens.
+ */
+static int quietListener(conn_t* conn, conn_pool_t* pool)
+{
+    return conn->protocol == PROTO_UNKNOWN && conn->read_len == 0 && !FD_ISSET(conn->fd, &pool->ready_read_set) &&
+           pool->timers.now_ms - conn->last_active >= PROTOCOL_WAIT_MS;
+}
+
+/*
+ * Schedules the connection's idle timer for the next time it has to be pinged or closed,
+ * or have its held output settled as text, counting from its last input. Nothing is
+ * scheduled when none of these applies.
+ */
+static void scheduleIdleCheck(conn_t* conn, conn_pool_t* pool)
+{
+    long long idle = pool->timers.now_ms - conn->last_active;
+    long long delay = LLONG_MAX;
+
+    if (pool->config.ping_interval > 0 && conn->protocol == PROTO_BINARY && !conn->ping_sent)
+        delay = pool->config.ping_interval - idle;
+    if (pool->config.idle_timeout > 0 && pool->config.idle_timeout - idle < delay)
+        delay = pool->config.idle_timeout - idle;
+    if (conn->protocol == PROTO_UNKNOWN && conn->read_len == 0 && conn->write_msg_head && PROTOCOL_WAIT_MS - idle < delay)
+        delay = PROTOCOL_WAIT_MS - idle;
+
+    if (delay != LLONG_MAX)
+        scheduleTimer(&pool->timers, &conn->idle_timer, delay);
+}
+
+/*
+ * State shared with the timer callbacks while the timer wheel advances.
+ */
+typedef struct timer_context {
+    conn_pool_t *pool;
+    /* Set when a connection was closed. */
+    int closed;
+}timer_context_t;
+
+/*
+ * Handles a due idle check: closes the connection, pings it or settles its protocol, and
+ * schedules the next check.
+ */
+static void expireIdleConnection(chat_timer_t* timer, void* arg)
+{
+    timer_context_t* context = (timer_context_t*) arg;
+    conn_pool_t* pool = context->pool;
+    conn_t* conn = (conn_t*) timer->data;
+
+    // Input that arrived while the loop was waiting has not been read yet, and input of a
+    // rate limited connection is waiting to be read.
+    if (FD_ISSET(conn->fd, &pool->ready_read_set) || conn->read_paused)
+        conn->last_active = pool->timers.now_ms;
+    long long idle = pool->timers.now_ms - conn->last_active;
+
+    if (pool->config.idle_timeout > 0 && idle >= pool->config.idle_timeout)
     {
-        printf("Connection closed for sd %d\n", sd);
-        printf("removing connection with sd %d \n", sd);
+        int sd = conn->fd;
+        PRINT_INFO(pool, "Idle timeout, removing connection with sd %d \n", sd);
         removeConn(sd, pool);
-        updateMaxFd(pool, welcome_socket); // Recalculate maxfd
+        context->closed = 1;
+        return;
+    }
+
+    // Binary clients answer pings; a dead peer makes the write fail and the connection close.
+    if (pool->config.ping_interval > 0 && conn->protocol == PROTO_BINARY && !conn->ping_sent &&
+        idle >= pool->config.ping_interval)
+    {
+        deliverMessage(conn, FRAME_PING, conn->room, "", 0, pool);
+        conn->ping_sent = 1;
     }
+
+    if (conn->write_msg_head && quietListener(conn, pool))
+        startProtocol(conn, PROTO_TEXT, pool);
+
+    scheduleIdleCheck(conn, pool);
+}
+
+/*
+ * Adds the tokens earned since the last refill, up to one second's worth.
+ */
+static void refillBucket(token_bucket_t* bucket, int rate, long long now)
+{
+    long long capacity = (long long)rate * BUCKET_TOKEN_UNIT;
+    bucket->tokens += (now - bucket->refilled) * rate; // rate per second is rate units per millisecond
+    if (bucket->tokens > capacity)
+        bucket->tokens = capacity;
+    bucket->refilled = now;
+}
+
+/*
+ * Returns the milliseconds until an overdrawn bucket is back to zero, or 0 if it is not overdrawn.
+ */
+static long long bucketDelay(const token_bucket_t* bucket, int rate)
+{
+    return bucket->tokens < 0 ? (-bucket->tokens + rate - 1) / rate : 0;
+}
+
+/*
+ * Refills the connection's buckets and returns how long reading has to pause for both
+ * of them to be out of debt, or 0 if it can go on.
+ */
+static long long rateLimitDelay(conn_t* conn, conn_pool_t* pool)
+{
+    long long now = pool->timers.now_ms;
+    long long delay = 0;
+
+    if (pool->config.rate_msgs > 0)
+    {
+        refillBucket(&conn->msg_bucket, pool->config.rate_msgs, now);
+        delay = bucketDelay(&conn->msg_bucket, pool->config.rate_msgs);
+    }
+    if (pool->config.rate_bytes > 0)
+    {
+        refillBucket(&conn->byte_bucket, pool->config.rate_bytes, now);
+        long long bytes_delay = bucketDelay(&conn->byte_bucket, pool->config.rate_bytes);
+        if (bytes_delay > delay)
+            delay = bytes_delay;
+    }
+
+    return delay;
+}
+
+/*
+ * Stops watching a connection that went over its rate limit for input until its buckets
+ * have refilled. What the client sends meanwhile waits in the socket buffer, and TCP flow
+ * control eventually slows the client down; it is not disconnected.
+ */
+static void pauseReading(conn_t* conn, long long delay, conn_pool_t* pool)
+{
+    PRINT_DEBUG(pool, "Rate limit, pausing sd %d for %lld ms\n", conn->fd, delay);
+    FD_CLR(conn->fd, &pool->read_set);
+    if (conn->backlogged)
+        pool->nr_backlogged--; // The backlog waits for the pause to end.
+    conn->read_paused = 1;
+    scheduleTimer(&pool->timers, &conn->rate_timer, delay);
+}
+
+/*
+ * Resumes reading from a paused connection once its buckets are out of debt.
+ */
+static void resumeReading(chat_timer_t* timer, void* arg)
+{
+    conn_pool_t* pool = ((timer_context_t*) arg)->pool;
+    conn_t* conn = (conn_t*) timer->data;
+
+    long long delay = rateLimitDelay(conn, pool);
+    if (delay > 0)
+    {
+        // The socket is not watched meanwhile, so its zero-copy completions are reaped here.
+        if (conn->zc_head)
+            reapZerocopyCompletions(conn);
+        scheduleTimer(&pool->timers, &conn->rate_timer, delay);
+        return;
+    }
+
+    FD_SET(conn->fd, &pool->read_set);
+    if (conn->backlogged)
+        pool->nr_backlogged++;
+    conn->read_paused = 0;
+}
+
+/*
+ * Lets go of the connection's read buffer: a buffer of the default size goes back to the
+ * pool's free list, a larger one is freed, and the batch buffer is simply dropped.
+ */
+static void releaseReadBuffer(conn_t* conn, conn_pool_t* pool)
+{
+    if (conn->read_buf != pool->read_batch)
+    {
+        if (conn->read_cap == BUFFER_SIZE && pool->nr_free_read_bufs < MAX_FREE_READ_BUFFERS)
+            pool->free_read_bufs[pool->nr_free_read_bufs++] = conn->read_buf;
+        else
+            free(conn->read_buf);
+    }
+
+    conn->read_buf = NULL;
+    conn->read_len = 0;
+    conn->read_cap = 0;
+}
+
+/*
+ * Moves the input left in the batch buffer into a buffer of the connection's own, taken
+ * from the pool's free list when it fits the default size. A connection that consumed
+ * all of its input keeps no buffer.
+ *
+ * Returns -1 if the buffer cannot be allocated; the input is lost.
+ */
+static int keepInput(conn_t* conn, conn_pool_t* pool)
+{
+    if (conn->read_len == 0)
+    {
+        releaseReadBuffer(conn, pool);
+        return 0;
+    }
+    if (conn->read_buf != pool->read_batch)
+        return 0; // A backlog handled in the connection's own buffer
+
+    int size = conn->read_len > BUFFER_SIZE ? conn->read_len : BUFFER_SIZE;
+    char* read_buf;
+    if (size == BUFFER_SIZE && pool->nr_free_read_bufs > 0)
+        read_buf = pool->free_read_bufs[--pool->nr_free_read_bufs];
     else
-        perror("Error reading from socket");
+        read_buf = (char*) malloc(size);
+    if (!read_buf)
+    {
+        fprintf(stderr, "malloc failed\n");
+        releaseReadBuffer(conn, pool);
+        return -1;
+    }
+
+    memcpy(read_buf, pool->read_batch, conn->read_len);
+    conn->read_buf = read_buf;
+    conn->read_cap = size;
+    return 0;
 }
 
-int acceptNewConnection(int welcome_socket, conn_pool_t* pool)
+void processDataFromConnection(int sd, conn_pool_t* pool)
 {
-    int new_socket = accept(welcome_socket, NULL, NULL);
-    if (new_socket < 0)
+    conn_t* conn = pool->conns_by_fd[sd];
+    if (!conn)
     {
-        perror("accept failed");
+        fprintf(stderr, "No connection found for sd %d\n", sd);
+        return;
+    }
+
+    // Zero-copy completions make the socket readable; release their payloads first.
+    if (conn->zc_head)
+        reapZerocopyCompletions(conn);
+
+    int protocol = conn->protocol;
+    int limited = pool->config.rate_msgs > 0 || pool->config.rate_bytes > 0;
+
+    int budget = pool->config.read_budget > 0 ? pool->config.read_budget : INT_MAX;
+    for (int reads = 0; ; reads++)
+    {
+        int drained = 1;
+
+        // Messages left over by the read budget come first; the socket is read once they are handled.
+        if (!conn->backlogged)
+        {
+            // The read lands in the batch buffer behind the room left for the input carried over.
+            char* batch = pool->read_batch;
+            int room = READ_BATCH_SIZE - conn->read_len;
+            if (reads == 0)
+                PRINT_DEBUG(pool, "Descriptor %d is readable\n", sd);
+            // A packet socket reports the full length of a packet that did not fit
+            ssize_t bytes_read = recv(sd, batch + conn->read_len, room, conn->seqpacket ? MSG_TRUNC : 0);
+            if (bytes_read > room)
+            {
+                PRINT_INFO(pool, "Packet larger than %d bytes, removing connection with sd %d \n", MAX_SEQPACKET_SIZE, sd);
+                removeConn(sd, pool);
+                updateMaxFd(pool); // Recalculate maxfd
+                return;
+            }
+            if (bytes_read == 0)
+            {
+                PRINT_DEBUG(pool, "Connection closed for sd %d\n", sd);
+                PRINT_DEBUG(pool, "removing connection with sd %d \n", sd);
+                removeConn(sd, pool);
+                updateMaxFd(pool); // Recalculate maxfd
+                return;
+            }
+            if (bytes_read < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                {
+                    perror("Error reading from socket");
+                    PRINT_DEBUG(pool, "removing connection with sd %d \n", sd);
+                    removeConn(sd, pool);
+                    updateMaxFd(pool); // Recalculate maxfd
+                    return;
+                }
+                break;
+            }
+
+            // The input is handled in place in the batch buffer.
+            int carried = conn->read_len;
+            if (carried > 0)
+                memcpy(batch, conn->read_buf, carried);
+            releaseReadBuffer(conn, pool);
+            conn->read_buf = batch;
+            conn->read_len = carried;
+            conn->read_cap = READ_BATCH_SIZE;
+
+            PRINT_DEBUG(pool, "%zd bytes received from sd %d\n", bytes_read, sd);
+            conn->read_len += (int)bytes_read;
+            conn->last_active = pool->timers.now_ms; // The idle check looks at this when it fires
+            conn->ping_sent = 0;
+            if (limited)
+                rateLimitDelay(conn, pool); // Refill before charging, so the cap only applies to earned tokens
+            chargeBucket(&conn->byte_bucket, pool->config.rate_bytes, bytes_read);
+            drained = !conn->seqpacket && bytes_read < room; // A short read took everything the socket had
+        }
+
+        if (processInput(conn, &budget, pool) != 0)
+        {
+            PRINT_INFO(pool, "Protocol error, removing connection with sd %d \n", sd);
+            removeConn(sd, pool);
+            updateMaxFd(pool); // Recalculate maxfd
+            return;
+        }
+        if (keepInput(conn, pool) != 0)
+        {
+            PRINT_DEBUG(pool, "removing connection with sd %d \n", sd);
+            removeConn(sd, pool);
+            updateMaxFd(pool); // Recalculate maxfd
+            return;
+        }
+
+        // A socket that filled the batch buffer is read again while the budget and the rate limits allow.
+        if (drained || budget == 0 || reads + 1 == MAX_READS_PER_EVENT || (limited && rateLimitDelay(conn, pool) > 0))
+            break;
+    }
+
+    if (!timerPending(&conn->idle_timer) || conn->protocol != protocol)
+        scheduleIdleCheck(conn, pool); // Pinged, or the protocol was just negotiated
+
+    long long delay = limited ? rateLimitDelay(conn, pool) : 0;
+    if (delay > 0)
+        pauseReading(conn, delay, pool);
+}
+
+int setConnRing(conn_t* conn, shm_ring_t* ring, conn_pool_t* pool)
+{
+    conn->ring = (shm_ring_t*) malloc(sizeof(shm_ring_t));
+    if (!conn->ring)
+    {
+        fprintf(stderr, "malloc failed\n");
+        closeShmRing(ring);
         return -1;
     }
+    *conn->ring = *ring;
 
-    if (addConn(new_socket, pool) < 0)
+    conn->ring_prev = NULL;
+    conn->ring_next = pool->ring_head;
+    if (pool->ring_head)
+        pool->ring_head->ring_prev = conn;
+    pool->ring_head = conn;
+
+    FD_SET(ring->eventfd, &pool->read_set);
+    updateMaxFd(pool);
+    return 0;
+}
+
+/*
+ * Creates a ring for a connection accepted on a shm listener and sends it to the producer.
+ */
+static int createConnRing(conn_t* conn, conn_pool_t* pool)
+{
+    shm_ring_t ring;
+    if (createShmRing(&ring) != 0)
+        return -1;
+    if (sendShmRing(conn->fd, &ring) != 0)
     {
-        fprintf(stderr, "Failed to add new connection to pool\n");
-        close(new_socket);
+        closeShmRing(&ring);
         return -1;
     }
+    return setConnRing(conn, &ring, pool);
+}
+
+/*
+ * Detaches and closes a connection's shared-memory ring.
+ */
+static void closeConnRing(conn_t* conn, conn_pool_t* pool)
+{
+    if (!conn->ring)
+        return;
+
+    if (conn->ring_prev)
+        conn->ring_prev->ring_next = conn->ring_next;
+    else
+        pool->ring_head = conn->ring_next;
+    if (conn->ring_next)
+        conn->ring_next->ring_prev = conn->ring_prev;
+
+    FD_CLR(conn->ring->eventfd, &pool->read_set);
+    FD_CLR(conn->ring->eventfd, &pool->ready_read_set);
+    closeShmRing(conn->ring);
+    free(conn->ring);
+    conn->ring = NULL;
+}
+
+/*
+ * Handles the records in a connection's ring as lines of text, up to the read budget
+ * and while the rate limits allow. Returns -1 if the ring is corrupt.
+ */
+static int processRing(conn_t* conn, int* budget, conn_pool_t* pool)
+{
+    int limited = pool->config.rate_msgs > 0 || pool->config.rate_bytes > 0;
+    char line[SHM_MAX_RECORD + 1];
+    const char* record;
+    uint32_t len;
 
-    printf("New incoming connection on sd %d\n", new_socket);
-    updateMaxFd(pool, welcome_socket); // Recalculate maxfd
+    while (*budget > 0 && (record = peekShmRecord(conn->ring, &len)) != NULL)
+    {
+        if (record == SHM_RECORD_INVALID)
+            return -1;
+
+        // A record before any bytes on the socket makes it a text connection
+        if (conn->protocol == PROTO_UNKNOWN)
+            startProtocol(conn, PROTO_TEXT, pool);
+
+        // The producer may write to the ring at any time; the line is handled from a copy.
+        memcpy(line, record, len);
+        consumeShmRecord(conn->ring, len);
+
+        conn->last_active = pool->timers.now_ms;
+        conn->ping_sent = 0;
+        if (limited)
+            rateLimitDelay(conn, pool); // Refill before charging, as for reads
+        chargeBucket(&conn->byte_bucket, pool->config.rate_bytes, len);
+
+        // A record holding line terminators is split into its lines, as input on the socket is
+        char* start = line;
+        char* end = line + len;
+        do
+        {
+            char* newline = memchr(start, '\n', end - start);
+            char* stop = newline ? newline + 1 : end;
+            handleLine(conn, start, (int)(stop - start), pool);
+            start = stop;
+        } while (start < end);
+        (*budget)--;
+
+        if (limited && rateLimitDelay(conn, pool) > 0)
+            break;
+    }
     return 0;
 }
 
-void capitalizeMessage(char* message, int length)
+void pollShmRings(conn_pool_t* pool)
+{
+    int closed = 0;
+    conn_t* next;
+    for (conn_t* conn = pool->ring_head; conn != NULL; conn = next)
+    {
+        next = conn->ring_next;
+        int eventfd = conn->ring->eventfd;
+        int signalled = FD_ISSET(eventfd, &pool->ready_read_set);
+        if (signalled)
+        {
+            FD_CLR(eventfd, &pool->ready_read_set);
+            pool->nready--;
+        }
+        disarmShmRing(conn->ring, signalled);
+        if (conn->read_paused)
+            continue; // Resumed by the rate timer, like reads from the socket
+
+        int budget = pool->config.read_budget > 0 ? pool->config.read_budget : INT_MAX;
+        if (processRing(conn, &budget, pool) != 0)
+        {
+            PRINT_INFO(pool, "Corrupt shared ring, removing connection with sd %d \n", conn->fd);
+            removeConn(conn->fd, pool);
+            closed = 1;
+            continue;
+        }
+
+        long long delay = pool->config.rate_msgs > 0 || pool->config.rate_bytes > 0 ? rateLimitDelay(conn, pool) : 0;
+        if (delay > 0)
+            pauseReading(conn, delay, pool);
+    }
+    if (closed)
+        updateMaxFd(pool); // Recalculate maxfd
+}
+
+int armShmRings(conn_pool_t* pool)
 {
-    for (int i = 0; i < length; ++i)
-        message[i] = (char)toupper((unsigned char)message[i]);
+    int pending = 0;
+    for (conn_t* conn = pool->ring_head; conn != NULL; conn = conn->ring_next)
+        if (!conn->read_paused && armShmRing(conn->ring))
+            pending = 1;
+    return pending;
 }
 
-void updateMaxFd(conn_pool_t* pool, int welcome_socket)
+/*
+ * Finds the listener with the given socket, or returns NULL.
+ */
+static listener_t* findListener(conn_pool_t* pool, int fd)
 {
-    int max_fd = welcome_socket; // Start with the welcome_socket's descriptor as the minimum
+    for (unsigned int i = 0; i < pool->nr_listeners; i++)
+        if (pool->listeners[i].fd == fd)
+            return &pool->listeners[i];
+    return NULL;
+}
 
-    // Iterate through all connections to find the highest file descriptor
-    for (conn_t* conn = pool->conn_head ; conn != NULL ; conn = conn->next)
-        if (conn->fd > max_fd)
-            max_fd = conn->fd;
+int acceptNewConnection(int listen_socket, conn_pool_t* pool)
+{
+    listener_t* listener = findListener(pool, listen_socket);
+    if (!listener)
+    {
+        fprintf(stderr, "No listener found for sd %d\n", listen_socket);
+        return -1;
+    }
+
+    int new_socket = accept(listen_socket, NULL, NULL);
+    if (new_socket < 0)
+    {
+        perror("accept failed");
+        return -1;
+    }
+
+    // Make the socket non-blocking so a slow client never stalls the server
+    int on = 1;
+    if (ioctl(new_socket, FIONBIO, (char*)&on) < 0)
+    {
+        perror("ioctl failed");
+        close(new_socket);
+        return -1;
+    }
+    tuneSocket(new_socket, listener->family, &pool->config); // Options the kernel rejects stopped the server at startup
+
+    if (addConn(new_socket, pool) < 0)
+    {
+        fprintf(stderr, "Failed to add new connection to pool\n");
+        close(new_socket);
+        return -1;
+    }
+
+    pool->conns_by_fd[new_socket]->seqpacket = listener->type == SOCK_SEQPACKET;
+
+    // A producer on a shm listener receives its ring before anything else
+    if (listener->shm && createConnRing(pool->conns_by_fd[new_socket], pool) != 0)
+    {
+        removeConn(new_socket, pool);
+        return -1;
+    }
+
+    // Large broadcasts are sent with MSG_ZEROCOPY when the socket supports it
+    if (pool->config.zerocopy_threshold > 0 &&
+        setsockopt(new_socket, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0)
+        pool->conns_by_fd[new_socket]->zerocopy = 1;
+
+    PRINT_DEBUG(pool, "New incoming connection on sd %d\n", new_socket);
+    updateMaxFd(pool); // Recalculate maxfd
+    return 0;
+}
+
+void updateMaxFd(conn_pool_t* pool)
+{
+    int max_fd = pool->handoff_socket; // Start with the sockets that are always monitored
+    for (unsigned int i = 0; i < pool->nr_listeners; i++)
+        if (pool->listeners[i].fd > max_fd)
+            max_fd = pool->listeners[i].fd;
+
+    // Iterate through all connections to find the highest file descriptor
+    for (conn_t* conn = pool->conn_head ; conn != NULL ; conn = conn->next)
+        if (conn->fd > max_fd)
+            max_fd = conn->fd;
+    for (conn_t* conn = pool->ring_head ; conn != NULL ; conn = conn->ring_next)
+        if (conn->ring->eventfd > max_fd)
+            max_fd = conn->ring->eventfd;
+
+    // Update the pool's maxfd
+    pool->maxfd = max_fd;
+}
+
+
+/*
+ * Sets an integer socket option, reporting a failure with the option's name.
+ */
+static int setSocketOption(int sd, int level, int name, int value, const char* label)
+{
+    if (setsockopt(sd, level, name, &value, sizeof(value)) < 0)
+    {
+        fprintf(stderr, "Cannot set %s on sd %d: %s\n", label, sd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int tuneSocket(int sd, int family, const server_config_t* config)
+{
+    int result = 0;
+    int tcp = family != AF_UNIX;
+    if (tcp && config->tcp_nodelay && setSocketOption(sd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY") != 0)
+        result = -1;
+    if (config->sndbuf > 0 && setSocketOption(sd, SOL_SOCKET, SO_SNDBUF, config->sndbuf, "SO_SNDBUF") != 0)
+        result = -1;
+    if (config->rcvbuf > 0 && setSocketOption(sd, SOL_SOCKET, SO_RCVBUF, config->rcvbuf, "SO_RCVBUF") != 0)
+        result = -1;
+    if (tcp && config->notsent_lowat > 0 &&
+        setSocketOption(sd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, config->notsent_lowat, "TCP_NOTSENT_LOWAT") != 0)
+        result = -1;
+    if (tcp && config->busy_poll > 0 &&
+        setSocketOption(sd, SOL_SOCKET, SO_BUSY_POLL, config->busy_poll, "SO_BUSY_POLL") != 0)
+        result = -1;
+    return result;
+}
+
+/*
+ * Resolves a listen address (see addListener) into a socket address and type.
+ */
+static int resolveListenAddress(const char* address, struct sockaddr_storage* addr, socklen_t* addr_len, int* type)
+{
+    memset(addr, 0, sizeof(*addr));
+    *type = SOCK_STREAM;
+
+    int packet = strncmp(address, "unixpacket:", 11) == 0;
+    if (packet || strncmp(address, "unix:", 5) == 0 || strncmp(address, "shm:", 4) == 0)
+    {
+        struct sockaddr_un* un = (struct sockaddr_un*)addr;
+        const char* path = strchr(address, ':') + 1;
+        if (path[0] == '\0' || strlen(path) >= sizeof(un->sun_path))
+        {
+            fprintf(stderr, "Invalid Unix socket path: %s\n", path);
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        *addr_len = sizeof(*un);
+        if (packet)
+            *type = SOCK_SEQPACKET;
+        return 0;
+    }
+
+    // Split the host from the port; a bare port or * means any IPv4 address
+    char host[CONFIG_LINE_SIZE] = "0.0.0.0";
+    const char* port = address;
+    int ipv6 = address[0] == '[';
+    const char* end = ipv6 ? strchr(address, ']') : strrchr(address, ':');
+    if (ipv6 && (!end || end[1] != ':'))
+        port = ""; // Rejected below
+    else if (end)
+    {
+        const char* start = ipv6 ? address + 1 : address;
+        size_t len = (size_t)(end - start);
+        port = ipv6 ? end + 2 : end + 1;
+        if (len >= sizeof(host))
+            port = "";
+        else if (len > 0 && !(len == 1 && *start == '*'))
+        {
+            memcpy(host, start, len);
+            host[len] = '\0';
+        }
+    }
+
+    char* rest;
+    long number = strtol(port, &rest, 10);
+    if (*port == '\0' || *rest != '\0' || number < 1 || number > 65535)
+    {
+        fprintf(stderr, "Invalid listen address: %s\n", address);
+        return -1;
+    }
+
+    struct addrinfo hints;
+    struct addrinfo* result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = ipv6 ? AF_INET6 : AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV | (ipv6 ? AI_NUMERICHOST : 0);
+    int error = getaddrinfo(host, port, &hints, &result);
+    if (error != 0)
+    {
+        fprintf(stderr, "Cannot resolve %s: %s\n", address, gai_strerror(error));
+        return -1;
+    }
+    memcpy(addr, result->ai_addr, result->ai_addrlen);
+    *addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+int removeStaleSocket(const char* path, int type)
+{
+    struct stat st;
+    if (lstat(path, &st) < 0)
+    {
+        if (errno == ENOENT)
+            return 0;
+        fprintf(stderr, "Cannot check %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (!S_ISSOCK(st.st_mode))
+    {
+        fprintf(stderr, "%s exists and is not a socket\n", path);
+        return -1;
+    }
+
+    // Only a socket nobody is bound to refuses connections; a live one with a full
+    // backlog would block the probe, hence the non-blocking socket.
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int probe = socket(AF_UNIX, type | SOCK_NONBLOCK, 0);
+    if (probe < 0)
+    {
+        perror("Error creating socket");
+        return -1;
+    }
+    int refused = connect(probe, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno == ECONNREFUSED;
+    close(probe);
+    if (!refused)
+    {
+        fprintf(stderr, "%s is in use by another server\n", path);
+        return -1;
+    }
+
+    if (unlink(path) < 0 && errno != ENOENT)
+    {
+        fprintf(stderr, "Cannot remove %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int addListener(conn_pool_t* pool, const char* address)
+{
+    const server_config_t* config = &pool->config;
+    if (pool->nr_listeners == MAX_LISTENERS)
+    {
+        fprintf(stderr, "Cannot listen on more than %d addresses\n", MAX_LISTENERS);
+        return -1;
+    }
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int type;
+    if (resolveListenAddress(address, &addr, &addr_len, &type) != 0)
+        return -1;
+    int family = addr.ss_family;
+    int tcp = family != AF_UNIX;
+
+    int listen_socket = socket(family, type, 0);
+    if (listen_socket < 0)
+    {
+        perror("Error creating socket");
+        return -1;
+    }
+
+    // Make the socket non-blocking
+    int on = 1;
+    if (ioctl(listen_socket, FIONBIO, (char*)&on) < 0)
+    {
+        perror("ioctl failed");
+        close(listen_socket);
+        return -1;
+    }
+
+    // A restarted server can bind while connections of the previous one are in TIME_WAIT,
+    // and an IPv6 wildcard accepts IPv4 clients too, whatever the system default is.
+    // The receive buffer is set before listen so that the window scale is chosen for it.
+    if ((tcp && setSocketOption(listen_socket, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR") != 0) ||
+        (family == AF_INET6 && setSocketOption(listen_socket, IPPROTO_IPV6, IPV6_V6ONLY, 0, "IPV6_V6ONLY") != 0) ||
+        tuneSocket(listen_socket, family, config) != 0 ||
+        (tcp && config->defer_accept > 0 &&
+         setSocketOption(listen_socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, config->defer_accept, "TCP_DEFER_ACCEPT") != 0))
+    {
+        close(listen_socket);
+        return -1;
+    }
+
+    const char* path = tcp ? NULL : ((struct sockaddr_un*)&addr)->sun_path;
+    if (path && removeStaleSocket(path, type) != 0)
+    {
+        close(listen_socket);
+        return -1;
+    }
+
+    if (bind(listen_socket, (struct sockaddr*)&addr, addr_len) < 0)
+    {
+        fprintf(stderr, "Error binding %s: %s\n", address, strerror(errno));
+        close(listen_socket);
+        return -1;
+    }
+
+    // Set connections queue size
+    if (listen(listen_socket, config->listen_backlog) < 0)
+    {
+        perror("Listen failed");
+        close(listen_socket);
+        if (path)
+            unlink(path);
+        return -1;
+    }
+
+    return registerListener(pool, listen_socket, family, type, strncmp(address, "shm:", 4) == 0, path);
+}
+
+int registerListener(conn_pool_t* pool, int fd, int family, int type, int shm, const char* path)
+{
+    if (pool->nr_listeners == MAX_LISTENERS)
+    {
+        fprintf(stderr, "Cannot listen on more than %d addresses\n", MAX_LISTENERS);
+        return -1;
+    }
+
+    listener_t* listener = &pool->listeners[pool->nr_listeners++];
+    listener->fd = fd;
+    listener->family = family;
+    listener->type = type;
+    listener->shm = shm;
+    snprintf(listener->path, sizeof(listener->path), "%s", path ? path : "");
+
+    FD_SET(fd, &pool->read_set);
+    updateMaxFd(pool);
+    return 0;
+}
+
+void closeListeners(conn_pool_t* pool, int unlink_paths)
+{
+    for (unsigned int i = 0; i < pool->nr_listeners; i++)
+    {
+        listener_t* listener = &pool->listeners[i];
+        FD_CLR(listener->fd, &pool->read_set);
+        close(listener->fd);
+        if (unlink_paths && listener->path[0] != '\0')
+            unlink(listener->path);
+    }
+    pool->nr_listeners = 0;
+    updateMaxFd(pool);
+}
+
+
+void freeMessagesInQueue(conn_t* conn)
+{
+    if (!conn) // Safety check to ensure the connection pointer is not NULL.
+        return;
+
+    msg_t* msg = conn->write_msg_head; // Start with the head of the message queue.
+    while (msg != NULL)
+    {
+        msg_t* next_msg = msg->next; // Save the next message before freeing the current one.
+        if (msg->payload)
+            releasePayload(msg->payload); // Drop the reference to the shared content.
+        else
+            free(msg->message); // Free the message content.
+        free(msg); // Free the message structure itself.
+        msg = next_msg; // Move to the next message in the queue.
+    }
+    // After freeing all messages, reset the head and tail pointers of the queue.
+    conn->write_msg_head = conn->write_msg_tail = NULL;
+    conn->queued_bytes = 0;
+}
+
+/*
+ * Releases the payloads of the zero-copy sends reported as completed on a socket's error
+ * queue, removing them from the list of pending sends.
+ */
+static void reapCompletions(int fd, zc_pending_t** head, zc_pending_t** tail)
+{
+    while (*head != NULL)
+    {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return; // No more notifications queued.
+
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            // Sends [ee_info, ee_data] completed; TCP completes them in order.
+            while (*head != NULL && (int32_t)((*head)->seq - err.ee_data) <= 0)
+            {
+                zc_pending_t* done = *head;
+                *head = done->next;
+                releasePayload(done->payload);
+                free(done);
+            }
+            if (*head == NULL)
+                *tail = NULL;
+        }
+    }
+}
+
+/*
+ * Timer callback polling the closed connections that wait for zero-copy completions.
+ * A socket is closed once its sends have completed, or after ZC_LINGER_MS; the payloads
+ * of sends still pending then stay allocated, as the kernel may still read them.
+ */
+static void reapLingering(chat_timer_t* timer, void* arg)
+{
+    conn_pool_t* pool = ((timer_context_t*) arg)->pool;
+    long long now = pool->timers.now_ms;
+
+    zc_linger_t** link = &pool->zc_lingering;
+    while (*link != NULL)
+    {
+        zc_linger_t* linger = *link;
+        reapCompletions(linger->fd, &linger->zc_head, &linger->zc_tail);
+        if (linger->zc_head != NULL && now - linger->closed_at < ZC_LINGER_MS)
+        {
+            link = &linger->next;
+            continue;
+        }
+
+        if (linger->zc_head != NULL)
+            fprintf(stderr, "Zero-copy sends of sd %d did not complete, keeping their payloads\n", linger->fd);
+        while (linger->zc_head != NULL)
+        {
+            zc_pending_t* next = linger->zc_head->next;
+            free(linger->zc_head);
+            linger->zc_head = next;
+        }
+        close(linger->fd);
+        *link = linger->next;
+        free(linger);
+    }
+
+    if (pool->zc_lingering != NULL)
+        scheduleTimer(&pool->timers, timer, TIMER_TICK_MS);
+}
+
+/*
+ * Takes over the pending zero-copy sends of a connection being removed. Returns -1 if
+ * there are none left after reaping, in which case the socket can be closed right away.
+ */
+static int lingerForCompletions(conn_t* conn, conn_pool_t* pool)
+{
+    reapCompletions(conn->fd, &conn->zc_head, &conn->zc_tail);
+    if (conn->zc_head == NULL)
+        return -1;
+
+    zc_linger_t* linger = (zc_linger_t*) malloc(sizeof(zc_linger_t));
+    if (!linger)
+    {
+        // Without the socket the completions cannot be read; the payloads must never be freed.
+        fprintf(stderr, "malloc failed\n");
+        while (conn->zc_head != NULL)
+        {
+            zc_pending_t* next = conn->zc_head->next;
+            free(conn->zc_head);
+            conn->zc_head = next;
+        }
+        conn->zc_tail = NULL;
+        return -1;
+    }
+
+    // The client sees the connection closed, but the socket stays readable for the error queue.
+    shutdown(conn->fd, SHUT_RDWR);
+    linger->fd = conn->fd;
+    linger->zc_head = conn->zc_head;
+    linger->zc_tail = conn->zc_tail;
+    linger->closed_at = pool->timers.now_ms;
+    linger->next = pool->zc_lingering;
+    pool->zc_lingering = linger;
+    conn->zc_head = conn->zc_tail = NULL;
+    if (!timerPending(&pool->zc_linger_timer))
+        scheduleTimer(&pool->timers, &pool->zc_linger_timer, TIMER_TICK_MS);
+    return 0;
+}
+
+
+/*
+ * Appends a connection to the pool's dirty list if it is not already linked.
+ */
+static void markDirty(conn_t* conn, conn_pool_t* pool)
+{
+    // Output to a connection whose protocol is unknown is held until startProtocol.
+    if (conn->dirty || (conn->protocol == PROTO_UNKNOWN && !conn->overflowed))
+        return;
+
+    conn->dirty = 1;
+    conn->dirty_next = NULL;
+    conn->dirty_prev = pool->dirty_tail;
+    if (pool->dirty_tail)
+        pool->dirty_tail->dirty_next = conn;
+    else
+        pool->dirty_head = conn;
+    pool->dirty_tail = conn;
+}
+
+/*
+ * Removes a connection from the pool's dirty list if it is linked.
+ */
+static void clearDirty(conn_t* conn, conn_pool_t* pool)
+{
+    if (!conn->dirty)
+        return;
+
+    if (conn->dirty_prev)
+        conn->dirty_prev->dirty_next = conn->dirty_next;
+    else
+        pool->dirty_head = conn->dirty_next;
+    if (conn->dirty_next)
+        conn->dirty_next->dirty_prev = conn->dirty_prev;
+    else
+        pool->dirty_tail = conn->dirty_prev;
+
+    conn->dirty = 0;
+    conn->dirty_prev = conn->dirty_next = NULL;
+}
+
+/*
+ * Checks whether len more bytes fit in the connection's write queue. A connection that
+ * would go over max_queue_bytes is marked for the flush phase to close and gets no more
+ * output in the meantime.
+ */
+static int queueFull(conn_t* conn, size_t len, conn_pool_t* pool)
+{
+    if (!conn->overflowed &&
+        (pool->config.max_queue_bytes == 0 || conn->queued_bytes + len <= (size_t)pool->config.max_queue_bytes))
+        return 0;
+
+    conn->overflowed = 1;
+    markDirty(conn, pool);
+    return 1;
+}
+
+
+void initConfig(server_config_t* config)
+{
+    config->direct_write = 0; // Messages are written in the flush phase by default.
+    config->zerocopy_threshold = 0; // Zero-copy sends are disabled by default.
+    config->history_size = 0; // No history is kept by default.
+    config->log_dir = NULL; // Messages are not persisted by default.
+    config->log_sync = LOG_SYNC_INTERVAL; // Group commit once a second.
+    config->log_sync_param = 1000;
+    initTransforms(&config->transforms); // Messages are capitalized by default.
+    config->handoff_path = NULL; // No hot restart by default.
+    config->takeover_path = NULL;
+    config->drain_timeout = 5000; // Queued messages get five seconds to go out on shutdown.
+    config->idle_timeout = 0; // Idle connections are kept by default.
+    config->ping_interval = 0;
+    config->rate_msgs = 0; // Input is not rate limited by default.
+    config->rate_bytes = 0;
+    config->read_budget = 64; // Enough for a full read of short lines or frames.
+    config->max_queue_bytes = 0; // Write queues are not limited by default.
+    config->verbosity = VERBOSITY_INFO;
+    config->tcp_nodelay = 0; // Socket options keep the kernel defaults.
+    config->sndbuf = 0;
+    config->rcvbuf = 0;
+    config->notsent_lowat = 0;
+    config->busy_poll = 0;
+    config->defer_accept = 0;
+    config->listen_backlog = SOMAXCONN;
+}
+
+/* The key may be given with -o. */
+#define CONFIG_SOCKET 1
+/* A reload of the configuration file may change the value. */
+#define CONFIG_RELOADABLE 2
+
+/* Integer settings of the configuration file and the config fields they set. */
+static const struct {
+    const char *name;
+    size_t offset;
+    /* Factor from the unit of the file to the unit of the field. */
+    int scale;
+    int flags;
+} config_keys[] = {
+    { "direct_write", offsetof(server_config_t, direct_write), 1, CONFIG_RELOADABLE },
+    { "zerocopy_threshold", offsetof(server_config_t, zerocopy_threshold), 1, CONFIG_RELOADABLE },
+    { "history_size", offsetof(server_config_t, history_size), 1, 0 },
+    { "drain_timeout", offsetof(server_config_t, drain_timeout), 1, CONFIG_RELOADABLE },
+    { "idle_timeout", offsetof(server_config_t, idle_timeout), 1000, CONFIG_RELOADABLE },
+    { "ping_interval", offsetof(server_config_t, ping_interval), 1000, CONFIG_RELOADABLE },
+    { "rate_msgs", offsetof(server_config_t, rate_msgs), 1, CONFIG_RELOADABLE },
+    { "rate_bytes", offsetof(server_config_t, rate_bytes), 1, CONFIG_RELOADABLE },
+    { "read_budget", offsetof(server_config_t, read_budget), 1, CONFIG_RELOADABLE },
+    { "max_queue_bytes", offsetof(server_config_t, max_queue_bytes), 1, CONFIG_RELOADABLE },
+    { "nodelay", offsetof(server_config_t, tcp_nodelay), 1, CONFIG_SOCKET },
+    { "sndbuf", offsetof(server_config_t, sndbuf), 1, CONFIG_SOCKET },
+    { "rcvbuf", offsetof(server_config_t, rcvbuf), 1, CONFIG_SOCKET },
+    { "notsent_lowat", offsetof(server_config_t, notsent_lowat), 1, CONFIG_SOCKET },
+    { "busy_poll", offsetof(server_config_t, busy_poll), 1, CONFIG_SOCKET },
+    { "defer_accept", offsetof(server_config_t, defer_accept), 1, CONFIG_SOCKET },
+    { "backlog", offsetof(server_config_t, listen_backlog), 1, CONFIG_SOCKET },
+};
+#define NR_CONFIG_KEYS (sizeof(config_keys) / sizeof(config_keys[0]))
+
+/*
+ * Finds the integer setting with the given name among the keys with all of the given flags.
+ * Returns its index in config_keys, or -1.
+ */
+static int findConfigKey(const char* name, size_t len, int flags)
+{
+    for (size_t i = 0; i < NR_CONFIG_KEYS; i++)
+        if ((config_keys[i].flags & flags) == flags && strlen(config_keys[i].name) == len &&
+            strncmp(config_keys[i].name, name, len) == 0)
+            return (int)i;
+    return -1;
+}
+
+/*
+ * Parses the value of an integer setting: a non-negative number that stays within an int
+ * once scaled. Returns -1 if the value is invalid.
+ */
+static int parseConfigValue(const char* value, size_t len, int scale, int* result)
+{
+    char* end;
+    errno = 0;
+    long parsed = strtol(value, &end, 10);
+    if (end == value || end != value + len || errno != 0 || parsed < 0 || parsed > INT_MAX / scale)
+        return -1;
+    *result = (int)parsed * scale;
+    return 0;
+}
+
+int parseSocketOptions(const char* spec, server_config_t* config)
+{
+    while (*spec != '\0')
+    {
+        size_t len = strcspn(spec, ",");
+        const char* equals = memchr(spec, '=', len);
+        size_t name_len = equals ? (size_t)(equals - spec) : len;
+
+        int value = 1; // A bare name switches the option on
+        if (equals && parseConfigValue(equals + 1, len - name_len - 1, 1, &value) != 0)
+            return -1;
+
+        int key = findConfigKey(spec, name_len, CONFIG_SOCKET);
+        if (key < 0)
+            return -1;
+        *(int*)((char*)config + config_keys[key].offset) = value;
+
+        spec += len;
+        if (*spec == ',')
+            spec++;
+    }
+    return 0;
+}
+
+int parseVerbosity(const char* name, int* verbosity)
+{
+    static const char* const names[] = { "quiet", "info", "debug" };
+    for (int level = VERBOSITY_QUIET; level <= VERBOSITY_DEBUG; level++)
+    {
+        if (strcmp(name, names[level]) == 0)
+        {
+            *verbosity = level;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Sets one setting read from the configuration file. When reloading, a setting that
+ * only applies at startup keeps its value.
+ *
+ * Returns -1 if the key is unknown or the value is invalid.
+ */
+static int setConfigValue(server_config_t* config, const char* key, const char* value, int reload)
+{
+    int changed = 0;
+    if (strcmp(key, "verbosity") == 0)
+        return parseVerbosity(value, &config->verbosity);
+
+    if (strcmp(key, "transforms") == 0)
+    {
+        transform_pipeline_t pipeline;
+        if (parseTransforms(value, &pipeline) != 0)
+            return -1;
+        changed = memcmp(&pipeline, &config->transforms, sizeof(pipeline)) != 0;
+        if (!reload)
+            config->transforms = pipeline;
+    }
+    else if (strcmp(key, "log_sync") == 0)
+    {
+        int policy, param;
+        if (parseLogSync(value, &policy, &param) != 0)
+            return -1;
+        changed = policy != config->log_sync || param != config->log_sync_param;
+        if (!reload)
+        {
+            config->log_sync = policy;
+            config->log_sync_param = param;
+        }
+    }
+    else
+    {
+        int index = findConfigKey(key, strlen(key), 0);
+        int parsed;
+        if (index < 0 || parseConfigValue(value, strlen(value), config_keys[index].scale, &parsed) != 0)
+            return -1;
+
+        int* field = (int*)((char*)config + config_keys[index].offset);
+        changed = parsed != *field;
+        if (!reload || (config_keys[index].flags & CONFIG_RELOADABLE))
+        {
+            *field = parsed;
+            return 0;
+        }
+    }
+
+    if (reload && changed)
+        fprintf(stderr, "Setting %s only takes effect after a restart\n", key);
+    return 0;
+}
+
+int loadConfigFile(const char* path, server_config_t* config, int reload)
+{
+    FILE* file = fopen(path, "r");
+    if (!file)
+    {
+        fprintf(stderr, "Cannot open configuration file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // Settings are applied to a copy, so that a bad file changes nothing.
+    server_config_t parsed = *config;
+    char line[CONFIG_LINE_SIZE];
+    int line_number = 0;
+    int result = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        line_number++;
+
+        // Trim the line and skip comments and blank lines
+        char* key = line + strspn(line, " \t");
+        char* end = key + strlen(key);
+        while (end > key && isspace((unsigned char)end[-1]))
+            end--;
+        *end = '\0';
+        if (*key == '\0' || *key == '#')
+            continue;
+
+        // Split "key = value"
+        char* equals = strchr(key, '=');
+        char* value = equals ? equals + 1 + strspn(equals + 1, " \t") : NULL;
+        if (equals)
+        {
+            while (equals > key && isspace((unsigned char)equals[-1]))
+                equals--;
+            *equals = '\0';
+        }
+
+        if (!value || setConfigValue(&parsed, key, value, reload) != 0)
+        {
+            fprintf(stderr, "%s:%d: invalid setting\n", path, line_number);
+            result = -1;
+        }
+    }
+    fclose(file);
+
+    if (result == 0)
+        *config = parsed;
+    return result;
+}
+
+int reloadConfig(conn_pool_t* pool, const char* path)
+{
+    server_config_t config = pool->config;
+    if (loadConfigFile(path, &config, 1) != 0)
+    {
+        fprintf(stderr, "Keeping the current settings\n");
+        return -1;
+    }
+    int msgs_changed = config.rate_msgs != pool->config.rate_msgs;
+    int bytes_changed = config.rate_bytes != pool->config.rate_bytes;
+    pool->config = config;
+
+    long long now = pool->timers.now_ms;
+    for (conn_t* conn = pool->conn_head; conn != NULL; conn = conn->next)
+    {
+        // The idle checks were scheduled for the old timeouts
+        cancelTimer(&conn->idle_timer);
+        scheduleIdleCheck(conn, pool);
+
+        // A changed limit starts from a full bucket rather than from the old limit's balance
+        if (msgs_changed)
+        {
+            conn->msg_bucket.tokens = (long long)config.rate_msgs * BUCKET_TOKEN_UNIT;
+            conn->msg_bucket.refilled = now;
+        }
+        if (bytes_changed)
+        {
+            conn->byte_bucket.tokens = (long long)config.rate_bytes * BUCKET_TOKEN_UNIT;
+            conn->byte_bucket.refilled = now;
+        }
+        if (conn->read_paused && (msgs_changed || bytes_changed))
+            scheduleTimer(&pool->timers, &conn->rate_timer, 0); // Its pause was set for the old limit
+    }
+
+    PRINT_INFO(pool, "Reloaded settings from %s\n", path);
+    return 0;
+}
+
+
+int initPool(conn_pool_t* pool)
+{
+    if (!pool)
+    {
+        printf("Invalid pool pointer provided\n");
+        return -1; // Return -1 on failure, indicating the provided pointer is NULL.
+    }
+
+    // Set initial values for the connection pool structure.
+    pool->maxfd = -1; // Indicate no file descriptors are present.
+    pool->nr_listeners = 0;
+    pool->handoff_socket = -1; // Not listening for a successor.
+    pool->nr_backlogged = 0;
+    pool->nready = 0; // No file descriptors are initially ready.
+    // Clear file descriptor sets for reading and writing.
+    FD_ZERO(&pool->read_set);
+    FD_ZERO(&pool->ready_read_set);
+    FD_ZERO(&pool->write_set);
+    FD_ZERO(&pool->ready_write_set);
+    // Initialize the connection list to empty.
+    pool->conn_head = NULL;
+    pool->nr_conns = 0; // Initially, there are no connections in the pool.
+    memset(pool->conns_by_fd, 0, sizeof(pool->conns_by_fd));
+    memset(pool->nicks, 0, sizeof(pool->nicks));
+    pool->free_chunks = NULL;
+    pool->nr_free_chunks = 0;
+    pool->nr_free_read_bufs = 0;
+    pool->dirty_head = pool->dirty_tail = NULL;
+    pool->ring_head = NULL;
+    initConfig(&pool->config);
+    pool->log = NULL;
+    initTimerWheel(&pool->timers, currentTimeMs());
+    pool->zc_lingering = NULL;
+    initTimer(&pool->zc_linger_timer, reapLingering, NULL);
+    pool->read_batch = (char*) malloc(READ_BATCH_SIZE);
+    if (!pool->read_batch)
+    {
+        fprintf(stderr, "malloc failed\n");
+        return -1;
+    }
+
+    // Create the lobby, which every new connection joins.
+    pool->nr_rooms = 0;
+    if (findOrCreateRoom(pool, LOBBY_NAME) != LOBBY_ROOM)
+        return -1;
+
+    return 0; // Return 0 on successful initialization.
+}
+
+
+void destroyPool(conn_pool_t* pool)
+{
+    if (!pool)
+        return;
+
+    for (unsigned int i = 0; i < pool->nr_rooms; i++)
+    {
+        room_t* room = pool->rooms[i];
+        for (unsigned int slot = 0; room->history && slot < room->history_capacity; slot++)
+            if (room->history[slot])
+                releasePayload(room->history[slot]);
+        free(room->history);
+        free(room->members);
+        free(room);
+        pool->rooms[i] = NULL;
+    }
+    pool->nr_rooms = 0;
+
+    while (pool->free_chunks != NULL)
+    {
+        msg_t* next = pool->free_chunks->next;
+        free(pool->free_chunks->message);
+        free(pool->free_chunks);
+        pool->free_chunks = next;
+    }
+    pool->nr_free_chunks = 0;
+
+    // The process is exiting, so the sockets waiting for zero-copy completions can go.
+    cancelTimer(&pool->zc_linger_timer);
+    while (pool->zc_lingering != NULL)
+    {
+        zc_linger_t* next = pool->zc_lingering->next;
+        while (pool->zc_lingering->zc_head != NULL)
+        {
+            zc_pending_t* pending = pool->zc_lingering->zc_head;
+            pool->zc_lingering->zc_head = pending->next;
+            releasePayload(pending->payload);
+            free(pending);
+        }
+        close(pool->zc_lingering->fd);
+        free(pool->zc_lingering);
+        pool->zc_lingering = next;
+    }
+
+    while (pool->nr_free_read_bufs > 0)
+        free(pool->free_read_bufs[--pool->nr_free_read_bufs]);
+    free(pool->read_batch);
+    pool->read_batch = NULL;
+}
+
+
+int findOrCreateRoom(conn_pool_t* pool, const char* name)
+{
+    size_t name_len = strlen(name);
+    if (name_len == 0 || name_len >= ROOM_NAME_SIZE)
+        return -1;
+
+    // Rooms are only looked up by name on JOIN, so a linear scan is sufficient.
+    for (unsigned int i = 0; i < pool->nr_rooms; i++)
+        if (strcasecmp(pool->rooms[i]->name, name) == 0)
+            return (int)i;
+
+    if (pool->nr_rooms == MAX_ROOMS)
+    {
+        fprintf(stderr, "Room table is full\n");
+        return -1;
+    }
+
+    room_t* room = (room_t*) calloc(1, sizeof(room_t));
+    if (!room)
+    {
+        fprintf(stderr, "malloc failed\n");
+        return -1;
+    }
+    memcpy(room->name, name, name_len + 1);
+
+    pool->rooms[pool->nr_rooms] = room;
+    return (int)pool->nr_rooms++;
+}
+
+
+/*
+ * FNV-1a hash of a nickname, ignoring case.
+ */
+static unsigned int nickHash(const char* nick)
+{
+    unsigned int hash = 2166136261u;
+    for (; *nick; nick++)
+    {
+        hash ^= (unsigned char)tolower((unsigned char)*nick);
+        hash *= 16777619u;
+    }
+    return hash & (NICK_BUCKETS - 1);
+}
+
+
+conn_t* findConnByNick(conn_pool_t* pool, const char* nick)
+{
+    for (conn_t* conn = pool->nicks[nickHash(nick)]; conn != NULL; conn = conn->nick_next)
+        if (strcasecmp(conn->nick, nick) == 0)
+            return conn;
+
+    return NULL;
+}
+
+
+/*
+ * Removes a connection's nickname from the nickname hash table.
+ */
+static void unregisterNick(conn_t* conn, conn_pool_t* pool)
+{
+    if (conn->nick[0] == '\0')
+        return;
 
-    // Update the pool's maxfd
-    pool->maxfd = max_fd;
+    conn_t** link = &pool->nicks[nickHash(conn->nick)];
+    while (*link != NULL && *link != conn)
+        link = &(*link)->nick_next;
+
+    if (*link == conn)
+        *link = conn->nick_next;
+
+    conn->nick[0] = '\0';
+    conn->nick_next = NULL;
 }
 
 
-int initializeServer(in_port_t port)
+int setNick(conn_t* conn, const char* nick, conn_pool_t* pool)
 {
-    int welcome_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (welcome_socket < 0)
-    {
-        perror("Error creating socket");
+    size_t nick_len = strlen(nick);
+    if (nick_len == 0 || nick_len >= NICK_SIZE)
         return -1;
-    }
 
-    // Make the socket non-blocking
-    int on = 1;
-    if (ioctl(welcome_socket, FIONBIO, (char*)&on) < 0)
-    {
-        perror("ioctl failed");
-        close(welcome_socket);
-        return -1;
-    }
+    conn_t* owner = findConnByNick(pool, nick);
+    if (owner != NULL && owner != conn)
+        return -1; // Registered by another connection.
 
-    // Bind the socket to the specified port on any network interface
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(port);
-    if (bind(welcome_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0)
-    {
-        perror("Error binding socket");
-        close(welcome_socket);
-        return -1;
-    }
+    unregisterNick(conn, pool);
 
-    // Set connections queue size
-    if (listen(welcome_socket, 5) < 0)
-    {
-        perror("Listen failed");
-        close(welcome_socket);
-        return -1;
-    }
+    memcpy(conn->nick, nick, nick_len + 1);
+    unsigned int bucket = nickHash(nick);
+    conn->nick_next = pool->nicks[bucket];
+    pool->nicks[bucket] = conn;
 
-    return welcome_socket;
+    return 0;
 }
 
 
-void freeMessagesInQueue(conn_t* conn)
+/*
+ * Removes a connection from the members array of its current room.
+ */
+static void leaveRoom(conn_t* conn, conn_pool_t* pool)
 {
-    if (!conn) // Safety check to ensure the connection pointer is not NULL.
-        return;
+    room_t* room = pool->rooms[conn->room];
 
-    msg_t* msg = conn->write_msg_head; // Start with the head of the message queue.
-    while (msg != NULL)
-    {
-        msg_t* next_msg = msg->next; // Save the next message before freeing the current one.
-        free(msg->message); // Free the message content.
-        free(msg); // Free the message structure itself.
-        msg = next_msg; // Move to the next message in the queue.
-    }
-    // After freeing all messages, reset the head and tail pointers of the queue.
-    conn->write_msg_head = conn->write_msg_tail = NULL;
+    // Move the last member into the vacated slot to keep the array dense.
+    conn_t* last = room->members[--room->nr_members];
+    room->members[conn->room_index] = last;
+    last->room_index = conn->room_index;
+
+    conn->room = -1;
 }
 
 
-int initPool(conn_pool_t* pool)
+int joinRoom(conn_t* conn, int room, conn_pool_t* pool)
 {
-    if (!pool)
+    if (room < 0 || (unsigned int)room >= pool->nr_rooms)
+        return -1;
+
+    if (conn->room == room)
+        return 0; // Already a member.
+
+    // Make sure the new room has space before leaving the current one.
+    room_t* target = pool->rooms[room];
+    if (target->nr_members == target->capacity)
     {
-        printf("Invalid pool pointer provided\n");
-        return -1; // Return -1 on failure, indicating the provided pointer is NULL.
+        unsigned int capacity = target->capacity ? target->capacity * 2 : 8;
+        conn_t** members = (conn_t**) realloc(target->members, capacity * sizeof(conn_t*));
+        if (!members)
+        {
+            fprintf(stderr, "malloc failed\n");
+            return -1;
+        }
+        target->members = members;
+        target->capacity = capacity;
     }
 
-    // Set initial values for the connection pool structure.
-    pool->maxfd = -1; // Indicate no file descriptors are present.
-    pool->nready = 0; // No file descriptors are initially ready.
-    // Clear file descriptor sets for reading and writing.
-    FD_ZERO(&pool->read_set);
-    FD_ZERO(&pool->ready_read_set);
-    FD_ZERO(&pool->write_set);
-    FD_ZERO(&pool->ready_write_set);
-    // Initialize the connection list to empty.
-    pool->conn_head = NULL;
-    pool->nr_conns = 0; // Initially, there are no connections in the pool.
+    if (conn->room >= 0)
+        leaveRoom(conn, pool);
 
-    return 0; // Return 0 on successful initialization.
+    conn->room = room;
+    conn->room_index = target->nr_members;
+    conn->history_mark = target->history_count; // Everything before this is history to the connection.
+    target->members[target->nr_members++] = conn;
+
+    return 0;
 }
 
 
@@ -259,7 +2000,15 @@ int addConn(int sd, conn_pool_t* pool)
         return -1; // Return -1 on failure, indicating the provided pool pointer is NULL.
     }
 
-    // Allocate memory for the new connection structure.
+    if (sd < 0 || sd >= FD_SETSIZE)
+    {
+        fprintf(stderr, "Descriptor %d cannot be monitored by select\n", sd);
+        close(sd);
+        return -1;
+    }
+
+    // Allocate memory for the new connection structure; it gets a read buffer only when
+    // input is left over.
     conn_t* new_conn = (conn_t*) malloc(sizeof(conn_t));
     if (new_conn == NULL)
     {
@@ -272,6 +2021,44 @@ int addConn(int sd, conn_pool_t* pool)
     new_conn->fd = sd; // Assign the provided socket descriptor.
     new_conn->write_msg_head = NULL; // Initialize the message queue as empty.
     new_conn->write_msg_tail = NULL;
+    new_conn->read_buf = NULL;
+    new_conn->read_len = 0;
+    new_conn->read_cap = 0;
+    new_conn->protocol = PROTO_UNKNOWN; // Decided by the first bytes the client sends.
+    new_conn->nick[0] = '\0'; // No nickname until /nick is used.
+    new_conn->nick_next = NULL;
+    new_conn->dirty = 0; // Nothing to flush yet.
+    new_conn->dirty_prev = new_conn->dirty_next = NULL;
+    new_conn->write_blocked = 0;
+    new_conn->queued_bytes = 0;
+    new_conn->overflowed = 0;
+    new_conn->zerocopy = 0; // Enabled by acceptNewConnection when configured.
+    new_conn->seqpacket = 0; // Set by acceptNewConnection for packet sockets.
+    new_conn->ring = NULL; // Attached by acceptNewConnection on shm listeners.
+    new_conn->ring_prev = new_conn->ring_next = NULL;
+    new_conn->zc_next_seq = 0;
+    new_conn->zc_head = new_conn->zc_tail = NULL;
+    new_conn->last_active = pool->timers.now_ms;
+    new_conn->ping_sent = 0;
+    initTimer(&new_conn->idle_timer, expireIdleConnection, new_conn);
+    new_conn->msg_bucket.tokens = (long long)pool->config.rate_msgs * BUCKET_TOKEN_UNIT; // Start with a full second's worth
+    new_conn->byte_bucket.tokens = (long long)pool->config.rate_bytes * BUCKET_TOKEN_UNIT;
+    new_conn->msg_bucket.refilled = new_conn->byte_bucket.refilled = pool->timers.now_ms;
+    new_conn->rate_tag.window_start = 0;
+    new_conn->rate_tag.count = 0;
+    new_conn->read_paused = 0;
+    new_conn->backlogged = 0;
+    initTimer(&new_conn->rate_timer, resumeReading, new_conn);
+
+    // Every new connection starts in the lobby.
+    new_conn->room = -1;
+    if (joinRoom(new_conn, LOBBY_ROOM, pool) != 0)
+    {
+        free(new_conn);
+        close(sd);
+        return -1;
+    }
+
     new_conn->prev = NULL; // New connection will be the new head, so no previous connection.
     new_conn->next = pool->conn_head; // The current head becomes the next connection.
 
@@ -281,6 +2068,7 @@ int addConn(int sd, conn_pool_t* pool)
 
     // Set the new connection as the head of the doubly linked list in the pool.
     pool->conn_head = new_conn;
+    pool->conns_by_fd[sd] = new_conn;
 
     // Add the new connection's socket descriptor to the read set for monitoring.
     FD_SET(sd, &pool->read_set);
@@ -288,6 +2076,8 @@ int addConn(int sd, conn_pool_t* pool)
     // Increment the total number of active connections in the pool.
     pool->nr_conns++;
 
+    scheduleIdleCheck(new_conn, pool);
+
     return 0; // Return 0 on successful addition of the new connection.
 }
 
@@ -301,13 +2091,7 @@ int removeConn(int sd, conn_pool_t* pool)
     }
 
     // Find the connection in the pool.
-    conn_t* temp = pool->conn_head;
-    conn_t* prev = NULL;
-    while (temp != NULL && temp->fd != sd)
-    {
-        prev = temp;
-        temp = temp->next;
-    }
+    conn_t* temp = (sd >= 0 && sd < FD_SETSIZE) ? pool->conns_by_fd[sd] : NULL;
 
     // Check if the connection was found.
     if (temp == NULL)
@@ -315,9 +2099,19 @@ int removeConn(int sd, conn_pool_t* pool)
         fprintf(stderr, "Connection with sd %d not found\n", sd);
         return -1;
     }
+    conn_t* prev = temp->prev;
 
     // Free all messages in the connection's queue before removing it.
     freeMessagesInQueue(temp);
+    leaveRoom(temp, pool);
+    unregisterNick(temp, pool);
+    clearDirty(temp, pool);
+    cancelTimer(&temp->idle_timer);
+    cancelTimer(&temp->rate_timer);
+    setBacklogged(temp, 0, pool);
+    releaseReadBuffer(temp, pool);
+    closeConnRing(temp, pool);
+    pool->conns_by_fd[sd] = NULL;
 
     // Remove the connection from the doubly linked list.
     if (prev == NULL) // If removing the head of the list.
@@ -329,12 +2123,16 @@ int removeConn(int sd, conn_pool_t* pool)
     if (temp->next != NULL)
         temp->next->prev = prev;
 
-    // Update the file descriptor sets.
+    // Update the file descriptor sets, including the ready sets of the current select pass,
+    // so that the rest of the pass does not take the descriptor for a listener.
     FD_CLR(sd, &pool->read_set);
     FD_CLR(sd, &pool->write_set);
+    FD_CLR(sd, &pool->ready_read_set);
+    FD_CLR(sd, &pool->ready_write_set);
 
-    // Close the socket descriptor and free the connection structure.
-    close(sd);
+    // Close the socket descriptor, unless zero-copy sends still read from payloads, and free the connection structure.
+    if (lingerForCompletions(temp, pool) != 0)
+        close(sd);
     free(temp);
 
     // Decrement the number of connections.
@@ -344,8 +2142,12 @@ int removeConn(int sd, conn_pool_t* pool)
 }
 
 
-msg_t* createMessage(const char* buffer, int len)
+msg_t* createMessageIov(const struct iovec* iov, int iovcnt)
 {
+    int len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += (int)iov[i].iov_len;
+
     // Allocate memory for the msg_t structure.
     msg_t* message = (msg_t*) malloc(sizeof(msg_t));
     if (!message)
@@ -363,15 +2165,358 @@ msg_t* createMessage(const char* buffer, int len)
         return NULL;
     }
 
-    // Copy the provided message content into the newly allocated buffer.
-    memcpy(message->message, buffer, len);
+    // Copy the provided message parts into the newly allocated buffer.
+    char* dest = message->message;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+        dest += iov[i].iov_len;
+    }
     message->size = len; // Set the message size.
+    message->capacity = len;
+    message->offset = 0; // Nothing written yet.
+    message->payload = NULL; // The message owns its buffer.
     message->next = message->prev = NULL; // Initialize next and prev pointers to NULL.
 
     return message; // Return the pointer to the newly created message structure.
 }
 
-int addMsg(int sd, char* buffer, int len, conn_pool_t* pool)
+msg_t* createMessage(const char* buffer, int len)
+{
+    struct iovec iov = { (void*)buffer, (size_t)len };
+    return createMessageIov(&iov, 1);
+}
+
+payload_t* createPayload(int type, int room, const char* buffer, int len)
+{
+    payload_t* payload = (payload_t*) malloc(sizeof(payload_t) + FRAME_HEADER_SIZE + len + 1);
+    if (!payload)
+    {
+        fprintf(stderr, "malloc failed\n");
+        return NULL;
+    }
+
+    payload->refcnt = 1; // Owned by the caller.
+    payload->size = len;
+    encodeFrameHeader(payload->data, type, room, (uint32_t)len);
+    memcpy(payload->data + FRAME_HEADER_SIZE, buffer, len);
+    payload->data[FRAME_HEADER_SIZE + len] = '\n';
+    return payload;
+}
+
+void releasePayload(payload_t* payload)
+{
+    if (payload && --payload->refcnt == 0)
+        free(payload);
+}
+
+int enqueuePayload(conn_t* conn, payload_t* payload, conn_pool_t* pool)
+{
+    // Binary recipients get the frame header and the body, text recipients the body and the newline.
+    int binary = conn->protocol == PROTO_BINARY;
+    int size = binary ? FRAME_HEADER_SIZE + payload->size : payload->size + 1;
+    if (queueFull(conn, (size_t)size, pool))
+        return 0; // The connection is about to be closed.
+
+    msg_t* chunk = (msg_t*) malloc(sizeof(msg_t));
+    if (!chunk)
+    {
+        fprintf(stderr, "malloc failed\n");
+        return -1;
+    }
+
+    // The chunk points into the payload; capacity == size keeps it from being coalesced into.
+    payload->refcnt++;
+    chunk->payload = payload;
+    chunk->message = binary ? payload->data : payload->data + FRAME_HEADER_SIZE;
+    chunk->size = size;
+    chunk->capacity = chunk->size;
+    chunk->offset = 0;
+    chunk->next = NULL;
+    conn->queued_bytes += (size_t)size;
+
+    // Append the chunk at the end of the write queue.
+    int first = !conn->write_msg_head;
+    chunk->prev = conn->write_msg_tail;
+    if (conn->write_msg_tail)
+        conn->write_msg_tail->next = chunk;
+    else
+        conn->write_msg_head = chunk;
+    conn->write_msg_tail = chunk;
+
+    if (first && conn->protocol == PROTO_UNKNOWN)
+        scheduleIdleCheck(conn, pool); // The held output is settled once the wait is over.
+    markDirty(conn, pool);
+    return 0;
+}
+
+/*
+ * Adds a broadcast payload to a room's history, dropping the oldest message once the
+ * ring is full. The history takes its own reference to the payload.
+ */
+static void recordHistory(room_t* room, payload_t* payload, conn_pool_t* pool)
+{
+    if (!room->history)
+    {
+        room->history = (payload_t**) calloc(pool->config.history_size, sizeof(payload_t*));
+        if (!room->history)
+        {
+            fprintf(stderr, "malloc failed\n");
+            return;
+        }
+        room->history_capacity = (unsigned int)pool->config.history_size;
+    }
+
+    payload_t** slot = &room->history[room->history_count % room->history_capacity];
+    if (*slot)
+        releasePayload(*slot);
+    payload->refcnt++;
+    *slot = payload;
+    room->history_count++;
+}
+
+/*
+ * Adds a record read from the message log to the history of its room.
+ */
+static int restoreRecord(const log_record_t* record, void* arg)
+{
+    conn_pool_t* pool = (conn_pool_t*) arg;
+
+    char name[ROOM_NAME_SIZE];
+    if (record->room_len >= ROOM_NAME_SIZE)
+        return 0;
+    memcpy(name, record->room, record->room_len);
+    name[record->room_len] = '\0';
+
+    int room = findOrCreateRoom(pool, name);
+    if (room < 0)
+        return 0;
+
+    payload_t* payload = createPayload(FRAME_MSG, room, record->body, record->body_len);
+    if (!payload)
+        return 1;
+    recordHistory(pool->rooms[room], payload, pool);
+    releasePayload(payload);
+    return 0;
+}
+
+int restoreHistory(conn_pool_t* pool)
+{
+    if (!pool->log || pool->config.history_size == 0)
+        return 0;
+
+    uint64_t window = (uint64_t)pool->config.history_size * LOG_RESTORE_FACTOR;
+    uint64_t end = logEndOffset(pool->log);
+    return readLog(pool->log, end > window ? end - window : 0, restoreRecord, pool);
+}
+
+int replayHistory(conn_t* conn, conn_pool_t* pool)
+{
+    room_t* room = pool->rooms[conn->room];
+    if (!room->history)
+        return 0;
+
+    // Messages older than the ring has room for have been overwritten.
+    uint64_t end = conn->history_mark;
+    uint64_t start = room->history_count > room->history_capacity ? room->history_count - room->history_capacity : 0;
+    for (uint64_t seq = start; seq < end; seq++)
+        if (enqueuePayload(conn, room->history[seq % room->history_capacity], pool) != 0)
+            return -1;
+
+    return 0;
+}
+
+void reapZerocopyCompletions(conn_t* conn)
+{
+    reapCompletions(conn->fd, &conn->zc_head, &conn->zc_tail);
+}
+
+/*
+ * Records a zero-copy send made from a payload, keeping the payload alive until the
+ * kernel reports the send as completed.
+ */
+static void trackZerocopySend(conn_t* conn, payload_t* payload)
+{
+    uint32_t seq = conn->zc_next_seq++; // The kernel numbers every successful zero-copy send.
+
+    zc_pending_t* pending = (zc_pending_t*) malloc(sizeof(zc_pending_t));
+    if (!pending)
+    {
+        // Without tracking the payload must simply never be freed.
+        fprintf(stderr, "malloc failed\n");
+        payload->refcnt++;
+        return;
+    }
+
+    pending->next = NULL;
+    pending->seq = seq;
+    pending->payload = payload;
+    payload->refcnt++;
+
+    if (conn->zc_tail)
+        conn->zc_tail->next = pending;
+    else
+        conn->zc_head = pending;
+    conn->zc_tail = pending;
+}
+
+/*
+ * Returns an empty output chunk able to hold at least len bytes, reusing a chunk
+ * from the pool's free list when possible.
+ */
+static msg_t* allocChunk(conn_pool_t* pool, int len)
+{
+    msg_t* chunk;
+    if (len <= OUTPUT_CHUNK_SIZE && pool->free_chunks != NULL)
+    {
+        chunk = pool->free_chunks;
+        pool->free_chunks = chunk->next;
+        pool->nr_free_chunks--;
+    }
+    else
+    {
+        int capacity = len > OUTPUT_CHUNK_SIZE ? len : OUTPUT_CHUNK_SIZE;
+        chunk = (msg_t*) malloc(sizeof(msg_t));
+        char* buffer = (char*) malloc(capacity);
+        if (!chunk || !buffer)
+        {
+            fprintf(stderr, "malloc failed\n");
+            free(chunk);
+            free(buffer);
+            return NULL;
+        }
+        chunk->message = buffer;
+        chunk->capacity = capacity;
+    }
+
+    chunk->size = 0;
+    chunk->offset = 0;
+    chunk->payload = NULL;
+    chunk->next = chunk->prev = NULL;
+    return chunk;
+}
+
+void releaseChunk(conn_pool_t* pool, msg_t* chunk)
+{
+    if (chunk->payload)
+    {
+        // The chunk only refers to shared content.
+        releasePayload(chunk->payload);
+        free(chunk);
+        return;
+    }
+
+    // Keep standard-sized chunks for reuse; oversized ones go back to the allocator.
+    if (chunk->capacity == OUTPUT_CHUNK_SIZE && pool->nr_free_chunks < MAX_FREE_CHUNKS)
+    {
+        chunk->next = pool->free_chunks;
+        pool->free_chunks = chunk;
+        pool->nr_free_chunks++;
+        return;
+    }
+
+    free(chunk->message);
+    free(chunk);
+}
+
+int enqueueIov(conn_t* conn, const struct iovec* iov, int iovcnt, conn_pool_t* pool)
+{
+    int len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += (int)iov[i].iov_len;
+
+    if (conn->overflowed)
+        return 0; // The connection is about to be closed.
+
+    // Try to send right away when nothing is queued; only the unsent remainder is queued.
+    int skip = 0;
+    if (pool->config.direct_write && !conn->write_msg_head && !conn->write_blocked && conn->protocol != PROTO_UNKNOWN &&
+        !(conn->seqpacket && len > MAX_SEQPACKET_SIZE))
+    {
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = (struct iovec*)iov;
+        hdr.msg_iovlen = iovcnt;
+        ssize_t written = sendmsg(conn->fd, &hdr, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (written == len)
+            return 0;
+        // On errors the whole message is queued and the flush phase handles the failure
+        skip = written > 0 ? (int)written : 0;
+        len -= skip;
+    }
+    if (queueFull(conn, (size_t)len, pool))
+        return 0;
+
+    // Coalesce into the last chunk of the queue when the message fits.
+    msg_t* chunk = conn->write_msg_tail;
+    if (!chunk || chunk->capacity - chunk->size < len)
+    {
+        chunk = allocChunk(pool, len);
+        if (!chunk)
+            return -1;
+
+        // Add the chunk to the write queue of the connection.
+        if (!conn->write_msg_tail) // If the queue is empty.
+            // Set both head and tail to the new chunk for an empty queue.
+            conn->write_msg_head = conn->write_msg_tail = chunk;
+
+        else // For a non-empty queue.
+        {
+            // Append the new chunk at the end of the queue.
+            conn->write_msg_tail->next = chunk;
+            chunk->prev = conn->write_msg_tail;
+            conn->write_msg_tail = chunk;
+        }
+    }
+
+    // Copy the message parts into the chunk, leaving out the bytes already sent.
+    for (int i = 0; i < iovcnt; i++)
+    {
+        int part = (int)iov[i].iov_len;
+        if (skip >= part)
+        {
+            skip -= part;
+            continue;
+        }
+        memcpy(chunk->message + chunk->size, (char*)iov[i].iov_base + skip, part - skip);
+        chunk->size += part - skip;
+        skip = 0;
+    }
+    conn->queued_bytes += (size_t)len;
+
+    // Mark the connection as having output to flush.
+    markDirty(conn, pool);
+
+    return 0;
+}
+
+int enqueueMessage(conn_t* conn, const char* buffer, int len, conn_pool_t* pool)
+{
+    struct iovec iov = { (void*)buffer, (size_t)len };
+    return enqueueIov(conn, &iov, 1, pool);
+}
+
+int deliverMessage(conn_t* conn, int type, int room, const char* body, int len, conn_pool_t* pool)
+{
+    char header[FRAME_HEADER_SIZE];
+    struct iovec iov[2];
+
+    if (conn->protocol == PROTO_BINARY)
+    {
+        encodeFrameHeader(header, type, room, (uint32_t)len);
+        iov[0] = (struct iovec){ header, FRAME_HEADER_SIZE };
+        iov[1] = (struct iovec){ (void*)body, (size_t)len };
+    }
+    else
+    {
+        iov[0] = (struct iovec){ (void*)body, (size_t)len };
+        iov[1] = (struct iovec){ "\n", 1 };
+    }
+
+    return enqueueIov(conn, iov, 2, pool);
+}
+
+int addMsgToRoom(int sd, int room, char* buffer, int len, conn_pool_t* pool)
 {
     if (!pool)
     {
@@ -379,39 +2524,92 @@ int addMsg(int sd, char* buffer, int len, conn_pool_t* pool)
         return -1; // Return -1 on failure, indicating an invalid pool pointer.
     }
 
-    // Iterate over all connections, excluding the sender.
-    for (conn_t* conn = pool->conn_head; conn != NULL; conn = conn->next)
+    if (room < 0 || (unsigned int)room >= pool->nr_rooms)
+    {
+        fprintf(stderr, "Invalid room %d\n", room);
+        return -1;
+    }
+
+    // Encode the message once for each protocol.
+    char header[FRAME_HEADER_SIZE];
+    encodeFrameHeader(header, FRAME_MSG, room, (uint32_t)len);
+    struct iovec text_iov[2] = { { buffer, (size_t)len }, { "\n", 1 } };
+    struct iovec frame_iov[2] = { { header, FRAME_HEADER_SIZE }, { buffer, (size_t)len } };
+
+    // Large messages are stored once and referenced by every recipient's queue; small
+    // ones are copied into the recipients' output chunks. The history keeps a payload
+    // of every message.
+    int share = pool->config.zerocopy_threshold > 0 && len >= pool->config.zerocopy_threshold;
+    payload_t* payload = NULL;
+    if (share || pool->config.history_size > 0)
+        payload = createPayload(FRAME_MSG, room, buffer, len);
+
+    // Iterate over the members of the room, excluding the sender.
+    room_t* target = pool->rooms[room];
+    for (unsigned int i = 0; i < target->nr_members; i++)
+    {
+        conn_t* conn = target->members[i];
         if (conn->fd != sd) // Check if the current connection is not the sender.
         {
-            // Create a new message for each connection.
-            msg_t* newMsg = createMessage(buffer, len);
-            if (!newMsg)
-            {
-                // If message creation fails, log the error and continue to the next connection.
+            // A connection whose protocol is unknown holds a payload, which can be re-encoded
+            // once the protocol is known, unless it has been quiet long enough to be a listener.
+            if (quietListener(conn, pool))
+                startProtocol(conn, PROTO_TEXT, pool);
+            int shared = share || conn->protocol == PROTO_UNKNOWN;
+            if (shared && !payload)
+                payload = createPayload(FRAME_MSG, room, buffer, len);
+
+            int result = -1;
+            if (shared && payload)
+                result = enqueuePayload(conn, payload, pool);
+            else if (conn->protocol != PROTO_UNKNOWN)
+                result = enqueueIov(conn, conn->protocol == PROTO_BINARY ? frame_iov : text_iov, 2, pool);
+
+            // If message creation fails, log the error and continue to the next connection.
+            if (result != 0)
                 fprintf(stderr, "Failed to create a new message for connection %d\n", conn->fd);
-                continue; // Continue to the next connection without halting the loop.
-            }
-
-            // Add the message to the write queue of the connection.
-            if (!conn->write_msg_tail) // If the queue is empty.
-                // Set both head and tail to the new message for an empty queue.
-                conn->write_msg_head = conn->write_msg_tail = newMsg;
+        }
+    }
 
-            else // For a non-empty queue.
-            {
-                // Append the new message at the end of the queue.
-                conn->write_msg_tail->next = newMsg;
-                newMsg->prev = conn->write_msg_tail;
-                conn->write_msg_tail = newMsg;
-            }
+    if (payload)
+    {
+        if (pool->config.history_size > 0)
+            recordHistory(target, payload, pool);
+        releasePayload(payload);
+    }
 
-            // Mark the connection as ready for writing.
-            FD_SET(conn->fd, &pool->write_set);
-        }
+    // Persist the message; only starting a new segment does I/O.
+    if (pool->log && appendToLog(pool->log, target->name, buffer, len) != 0)
+        fprintf(stderr, "Failed to append a message to the log\n");
 
     return 0; // Return 0 on success.
 }
 
+int addMsg(int sd, char* buffer, int len, conn_pool_t* pool)
+{
+    if (!pool)
+    {
+        fprintf(stderr, "Invalid pool pointer provided\n");
+        return -1; // Return -1 on failure, indicating an invalid pool pointer.
+    }
+
+    // Deliver to the sender's room; messages from other sources go to the lobby.
+    conn_t* sender = (sd >= 0 && sd < FD_SETSIZE) ? pool->conns_by_fd[sd] : NULL;
+    return addMsgToRoom(sd, sender ? sender->room : LOBBY_ROOM, buffer, len, pool);
+}
+
+
+/*
+ * Returns non-zero if a queued chunk should be sent with MSG_ZEROCOPY: it refers to a
+ * shared payload of at least the configured size and the socket supports zero-copy.
+ * Small payloads, such as replayed history, are cheaper to copy.
+ */
+static int isZerocopyChunk(const conn_t* conn, const msg_t* chunk, const conn_pool_t* pool)
+{
+    // A reload may have switched zero-copy off for sockets set up for it
+    return conn->zerocopy && pool->config.zerocopy_threshold > 0 && chunk->payload &&
+           chunk->payload->size >= pool->config.zerocopy_threshold;
+}
 
 int writeToClient(int sd, conn_pool_t* pool)
 {
@@ -422,9 +2620,7 @@ int writeToClient(int sd, conn_pool_t* pool)
     }
 
     // Find the connection in the pool matching the provided socket descriptor.
-    conn_t* conn = pool->conn_head;
-    while (conn && conn->fd != sd)
-        conn = conn->next;
+    conn_t* conn = (sd >= 0 && sd < FD_SETSIZE) ? pool->conns_by_fd[sd] : NULL;
 
     if (!conn)
     {
@@ -432,39 +2628,132 @@ int writeToClient(int sd, conn_pool_t* pool)
         return -1; // Return -1 if the connection is not found in the pool.
     }
 
-    // Iterate through the write queue of the connection and write each message.
-    msg_t* msg = conn->write_msg_head;
-    msg_t* next_msg = NULL;
-    int is_error = -1;
+    // Completions only wake up a connection that is read from; release their payloads here too.
+    if (conn->zc_head)
+        reapZerocopyCompletions(conn);
 
-    while (msg)
+    // Write the queued chunks with as few system calls as possible.
+    while (conn->write_msg_head)
     {
-        ssize_t written = write(sd, msg->message, msg->size);
-        if (written <= 0)
+        // Large shared payloads go out on their own with MSG_ZEROCOPY; everything else
+        // is gathered up to the next large shared payload.
+        payload_t* zerocopy = isZerocopyChunk(conn, conn->write_msg_head, pool) ? conn->write_msg_head->payload : NULL;
+
+        struct iovec iov[WRITE_IOV_MAX];
+        int iovcnt = 0;
+        size_t requested = 0;
+        for (msg_t* msg = conn->write_msg_head; msg != NULL && iovcnt < WRITE_IOV_MAX; msg = msg->next)
+        {
+            if (iovcnt > 0 && (zerocopy || isZerocopyChunk(conn, msg, pool)))
+                break;
+            // Each write to a packet socket is one packet, which must not outgrow what the peer reads
+            size_t len = (size_t)(msg->size - msg->offset);
+            if (conn->seqpacket && requested + len > MAX_SEQPACKET_SIZE)
+                len = MAX_SEQPACKET_SIZE - requested;
+            if (len == 0)
+                break;
+            iov[iovcnt].iov_base = msg->message + msg->offset;
+            iov[iovcnt].iov_len = len;
+            requested += len;
+            iovcnt++;
+        }
+
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = iovcnt;
+        ssize_t written = sendmsg(sd, &hdr, MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+        if (written < 0 && zerocopy && errno == ENOBUFS)
+        {
+            // Out of pinned-memory budget; let the kernel copy this one.
+            zerocopy = NULL;
+            written = sendmsg(sd, &hdr, MSG_NOSIGNAL);
+        }
+        if (written > 0 && zerocopy)
+            trackZerocopySend(conn, zerocopy);
+        if (written < 0)
         {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break; // The socket buffer is full; wait until select reports it writable.
+
             // Handle errors or connection closure during write operation.
             perror("Error writing to client");
-            is_error = 1;
-            break; // Exit the loop if a write error occurs.
+            return -1;
         }
 
-        // Proceed to the next message and free the current one.
-        next_msg = msg->next;
-        free(msg->message); // Free the message content.
-        free(msg); // Free the message structure.
+        // Release the chunks that were completely written and advance into the partial one.
+        size_t remaining = (size_t)written;
+        conn->queued_bytes -= remaining;
+        while (remaining > 0)
+        {
+            msg_t* msg = conn->write_msg_head;
+            size_t left = (size_t)(msg->size - msg->offset);
+            if (remaining < left)
+            {
+                msg->offset += (int)remaining;
+                break;
+            }
+
+            remaining -= left;
+            conn->write_msg_head = msg->next;
+            if (conn->write_msg_head)
+                conn->write_msg_head->prev = NULL;
+            else
+                conn->write_msg_tail = NULL;
+            releaseChunk(pool, msg);
+        }
 
-        msg = next_msg; // Move to the next message in the queue.
+        if ((size_t)written < requested)
+            break; // Short write: the socket buffer is full.
     }
 
-    if (is_error != 1)
+    if (!conn->write_msg_head)
     {
-        // Reset the connection's write queue indicators to show it's empty.
-        conn->write_msg_head = NULL;
-        conn->write_msg_tail = NULL;
+        // Clear the socket descriptor from the write set if no more messages are pending.
+        FD_CLR(sd, &pool->write_set);
+        clearDirty(conn, pool);
+    }
+    else
+    {
+        // Wait for select to report the socket writable before trying again.
+        FD_SET(sd, &pool->write_set);
+        conn->write_blocked = 1;
     }
-
-    // Clear the socket descriptor from the write set if no more messages are pending.
-    FD_CLR(sd, &pool->write_set);
 
     return 0; // Return 0 on success, indicating messages were written or no action was needed.
-}
\ No newline at end of file
+}
+
+void runTimers(conn_pool_t* pool)
+{
+    timer_context_t context = { pool, 0 };
+    advanceTimers(&pool->timers, currentTimeMs(), &context);
+    if (context.closed)
+        updateMaxFd(pool);
+}
+
+void flushPendingWrites(conn_pool_t* pool)
+{
+    conn_t* next;
+    for (conn_t* conn = pool->dirty_head; conn != NULL; conn = next)
+    {
+        next = conn->dirty_next; // The connection may leave the list below.
+        if (conn->overflowed)
+        {
+            int sd = conn->fd;
+            PRINT_INFO(pool, "Write queue full, removing connection with sd %d \n", sd);
+            removeConn(sd, pool);
+            updateMaxFd(pool);
+            continue;
+        }
+        if (conn->write_blocked)
+            continue;
+
+        if (writeToClient(conn->fd, pool) != 0)
+        {
+            int sd = conn->fd;
+            PRINT_DEBUG(pool, "removing connection with sd %d \n", sd);
+            removeConn(sd, pool);
+            updateMaxFd(pool);
+        }
+    }
+}
@@ -3,17 +3,312 @@
 
 #include <sys/select.h>
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <arpa/inet.h>
+#include <netdb.h>
 #include <ctype.h>
+#include <limits.h>
+#include "chatLog.h"
+#include "chatTimer.h"
+#include "chatShm.h"
+#include "chatTransform.h"
 
 #define BUFFER_SIZE 4096
-static int end_server = 0;
+/* Maximum number of rooms; room ids are indexes into the pool's room table. */
+#define MAX_ROOMS 1024
+/* Maximum length of a room name, including the terminating NUL. */
+#define ROOM_NAME_SIZE 32
+/* Id of the default room every new connection is placed in. */
+#define LOBBY_ROOM 0
+#define LOBBY_NAME "lobby"
+/* Maximum length of a nickname, including the terminating NUL. */
+#define NICK_SIZE 32
+/* Number of buckets in the nickname hash table (a power of two). */
+#define NICK_BUCKETS 1024
+/* Size of the output chunks small messages are coalesced into. */
+#define OUTPUT_CHUNK_SIZE 16384
+/* Maximum number of empty output chunks kept for reuse. */
+#define MAX_FREE_CHUNKS 256
+/* Maximum number of empty read buffers of BUFFER_SIZE bytes kept for reuse. */
+#define MAX_FREE_READ_BUFFERS 256
+/* Maximum number of chunks gathered by a single write. */
+#define WRITE_IOV_MAX 64
+/* Maximum number of addresses the server listens on. */
+#define MAX_LISTENERS 16
+/* Size of the path of a Unix domain socket, including the terminating NUL. */
+#define UNIX_PATH_SIZE sizeof(((struct sockaddr_un*)0)->sun_path)
+/*
+ * Largest packet sent or received on a SOCK_SEQPACKET connection. Packets of this size
+ * always fit in the read batch behind the input carried over from the previous read.
+ */
+#define MAX_SEQPACKET_SIZE 65536
+/* Upper bound for the number of messages kept in each room's history. */
+#define MAX_HISTORY_SIZE 65536
+/*
+ * At startup the room histories are refilled from the last history_size * LOG_RESTORE_FACTOR
+ * records of the message log, which is enough to fill this many busy rooms.
+ */
+#define LOG_RESTORE_FACTOR 16
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+/*
+ * Longest a closed connection's socket is kept open for the completions of its zero-copy
+ * sends. The payloads of sends still pending after that are never freed.
+ */
+#define ZC_LINGER_MS 30000
+/*
+ * Verbosity of the server's progress messages on stdout. Errors always go to stderr.
+ */
+#define VERBOSITY_QUIET 0
+#define VERBOSITY_INFO 1
+#define VERBOSITY_DEBUG 2
+
+/* Prints a progress message if the pool's verbosity is at least the given level. */
+#define PRINT_AT(pool, level, ...) \
+    do { if ((pool)->config.verbosity >= (level)) printf(__VA_ARGS__); } while (0)
+#define PRINT_INFO(pool, ...) PRINT_AT(pool, VERBOSITY_INFO, __VA_ARGS__)
+#define PRINT_DEBUG(pool, ...) PRINT_AT(pool, VERBOSITY_DEBUG, __VA_ARGS__)
+
+/* Maximum length of a line of the configuration file. */
+#define CONFIG_LINE_SIZE 256
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25
+#endif
+
+/*
+ * Binary framing protocol. A client that starts the connection with FRAME_HELLO
+ * switches to length-prefixed frames (the server echoes the hello back); any other
+ * first byte selects the text line protocol. Every frame starts with an 8-byte
+ * header: type (1 byte), flags (1 byte), room id (2 bytes) and payload length
+ * (4 bytes), multi-byte fields in network byte order.
+ */
+#define FRAME_HELLO "\xB1" "CH\x01"
+#define FRAME_HELLO_SIZE 4
+#define FRAME_HEADER_SIZE 8
+#define MAX_FRAME_PAYLOAD 65536
+/*
+ * Size of the pool's batch buffer every read lands in. It holds a partial frame of the
+ * maximum size carried over from the previous read with as much room again for new data.
+ */
+#define READ_BATCH_SIZE (2 * (FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD))
+/* Maximum number of reads from one connection per iteration of the event loop. */
+#define MAX_READS_PER_EVENT 8
+
+/* A chat message for a room; the payload is forwarded untouched. */
+#define FRAME_MSG 1
+/* Join the room named by the payload; echoed back with the room id as acknowledgement. */
+#define FRAME_JOIN 2
+/* Return to the lobby. */
+#define FRAME_LEAVE 3
+/* Register the nickname given by the payload. */
+#define FRAME_NICK 4
+/* Private message; the payload is a nickname, a NUL byte and the text. */
+#define FRAME_PRIVMSG 5
+/* Server notice (sent by the server only). */
+#define FRAME_NOTICE 6
+/* Heartbeat; answered with FRAME_PONG. The server pings binary clients that went quiet. */
+#define FRAME_PING 7
+/* Answer to FRAME_PING. */
+#define FRAME_PONG 8
+
+/* Protocols a connection can speak. */
+#define PROTO_UNKNOWN 0
+#define PROTO_TEXT 1
+#define PROTO_BINARY 2
+/*
+ * Milliseconds of silence after which a new connection that has sent nothing is taken
+ * for a text client that only listens. Broadcasts to a new connection are held until
+ * then, so that a binary client whose hello comes a little late gets them as frames.
+ */
+#define PROTOCOL_WAIT_MS 100
+
+/*
+ * Decoded header of a binary protocol frame.
+ */
+typedef struct frame_header {
+    uint8_t type;
+    uint8_t flags;
+    uint16_t room;
+    uint32_t length;
+}frame_header_t;
+
+/* Token buckets count tokens in thousandths so that refills are integer arithmetic. */
+#define BUCKET_TOKEN_UNIT 1000
+
+/*
+ * Token bucket limiting the rate of a connection's input. It holds up to one second's
+ * worth of tokens; a read may overdraw it, after which reading pauses until the bucket
+ * is back to zero.
+ */
+typedef struct token_bucket {
+    /* Available tokens in BUCKET_TOKEN_UNITs; negative when overdrawn. */
+    long long tokens;
+    /* Time of the last refill, in milliseconds of the pool's timer wheel. */
+    long long refilled;
+}token_bucket_t;
+
+/*
+ * Tunable server settings. initConfig fills in the defaults; main() overrides them
+ * from the command line.
+ */
+typedef struct server_config {
+    /*
+     * Non-zero to try sending a message immediately when the recipient has nothing
+     * queued, instead of waiting for the flush phase of the main loop. This saves a loop
+     * iteration of latency for uncongested clients at the cost of one write per message.
+     */
+    int direct_write;
+    /*
+     * Broadcast messages of at least this many bytes are shared by reference between
+     * the recipients' queues and sent with MSG_ZEROCOPY where the socket supports it.
+     * 0 disables zero-copy sends.
+     */
+    int zerocopy_threshold;
+    /*
+     * Number of recent broadcast messages kept per room and replayed to connections
+     * entering the room. 0 disables the history.
+     */
+    int history_size;
+    /* Directory of the persistent message log, or NULL to keep no log. */
+    const char *log_dir;
+    /* Sync policy of the message log (LOG_SYNC_*) and its interval or record count. */
+    int log_sync;
+    int log_sync_param;
+    /* Transforms applied to text messages before they are broadcast (-t). */
+    transform_pipeline_t transforms;
+    /* Path of the Unix socket a successor connects to for a hot restart, or NULL. */
+    const char *handoff_path;
+    /* Path of the handoff socket of a running server to take over, or NULL to start afresh. */
+    const char *takeover_path;
+    /*
+     * Milliseconds the server keeps delivering queued messages after a shutdown signal
+     * before closing the remaining connections. 0 closes them at once.
+     */
+    int drain_timeout;
+    /* Milliseconds without input after which a connection is closed. 0 disables the timeout. */
+    int idle_timeout;
+    /*
+     * Milliseconds without input after which a binary connection is sent a FRAME_PING.
+     * 0 disables the heartbeat.
+     */
+    int ping_interval;
+    /* Messages (lines, frames or commands) per second a connection may send. 0 means no limit. */
+    int rate_msgs;
+    /* Bytes per second a connection may send. 0 means no limit. */
+    int rate_bytes;
+    /*
+     * Messages handled per connection in one iteration of the main loop. What is left
+     * waits in the read buffer for the next iteration, so a busy connection cannot hold
+     * up the others. 0 means no limit.
+     */
+    int read_budget;
+    /*
+     * Bytes of output that may be queued for a connection. A client that does not keep
+     * up is closed once its queue would grow past this. 0 means no limit.
+     */
+    int max_queue_bytes;
+    /* Which progress messages are printed (VERBOSITY_*). */
+    int verbosity;
+    /*
+     * Socket options applied to the listening sockets and every accepted socket (-o). A value
+     * of 0 leaves the kernel default in place. The TCP options are skipped on Unix sockets.
+     */
+    /* Non-zero to disable Nagle's algorithm (TCP_NODELAY). */
+    int tcp_nodelay;
+    /* Send and receive buffer sizes in bytes (SO_SNDBUF, SO_RCVBUF). */
+    int sndbuf;
+    int rcvbuf;
+    /* Unsent bytes above which a socket stops being writable (TCP_NOTSENT_LOWAT). */
+    int notsent_lowat;
+    /* Microseconds to busy poll the device queue on a blocking receive or select (SO_BUSY_POLL). */
+    int busy_poll;
+    /* Seconds a connection may wait for its first data before it is accepted (TCP_DEFER_ACCEPT). */
+    int defer_accept;
+    /* Length of each listening socket's queue of pending connections. */
+    int listen_backlog;
+}server_config_t;
+
+/*
+ * Reference-counted broadcast message shared by several write queues and the room
+ * history, so that its body is stored once no matter how many recipients it has.
+ * The data holds the message encoded for both protocols at once: the frame header,
+ * the body and a newline. Binary recipients are sent the header and the body, text
+ * recipients the body and the newline.
+ */
+typedef struct payload {
+    /* Number of queue chunks, history slots and pending zero-copy sends referencing this payload. */
+    int refcnt;
+    /* Length of the message body. */
+    int size;
+    /* Frame header, message body and newline. */
+    char data[];
+}payload_t;
+
+/*
+ * A zero-copy send whose completion has not been reported by the kernel yet. The
+ * payload it sent from must stay alive until then.
+ */
+typedef struct zc_pending {
+    /* Next pending send on the same connection, in send order. */
+    struct zc_pending *next;
+    /* Sequence number the kernel assigned to the send. */
+    uint32_t seq;
+    /* Reference to the payload the send was made from, or NULL for sends made by a previous process. */
+    payload_t *payload;
+}zc_pending_t;
+
+/*
+ * A closed connection whose zero-copy sends have not all completed. Its socket is shut
+ * down but stays open, outside the select sets, until the kernel has reported them.
+ */
+typedef struct zc_linger {
+    struct zc_linger *next;
+    int fd;
+    /* Zero-copy sends awaiting completion, oldest first. */
+    struct zc_pending *zc_head;
+    struct zc_pending *zc_tail;
+    /* Time the connection was closed, in milliseconds of the pool's timer wheel. */
+    long long closed_at;
+}zc_linger_t;
+
+/*
+ * A socket the server accepts client connections on.
+ */
+typedef struct listener {
+    int fd;
+    /* Address family of the socket (AF_INET, AF_INET6 or AF_UNIX). */
+    int family;
+    /* Socket type (SOCK_STREAM, or SOCK_SEQPACKET for a Unix socket). */
+    int type;
+    /* Non-zero if every accepted connection is given a shared-memory ring. */
+    int shm;
+    /* Path of a Unix socket, removed when the server exits unless it was handed over; empty otherwise. */
+    char path[UNIX_PATH_SIZE];
+}listener_t;
 
 /*
  * Data structure to keep track of active client connections (not the for main socket).
@@ -35,15 +330,82 @@ typedef struct conn_pool {
     struct conn *conn_head;
     /* Number of active client connections. */
     unsigned int nr_conns;
+    /* Client connection objects indexed by their file descriptor. */
+    struct conn *conns_by_fd[FD_SETSIZE];
+    /* Rooms indexed by room id. Rooms are never freed while the pool is alive. */
+    struct room *rooms[MAX_ROOMS];
+    /* Number of rooms created so far. */
+    unsigned int nr_rooms;
+    /* Hash table of connections with a registered nickname, chained through conn->nick_next. */
+    struct conn *nicks[NICK_BUCKETS];
+    /* Singly-linked list of empty output chunks kept for reuse. */
+    struct msg *free_chunks;
+    /* Number of chunks in the free_chunks list. */
+    unsigned int nr_free_chunks;
+    /* Buffer of READ_BATCH_SIZE bytes that connections read into and handle their input in. */
+    char *read_batch;
+    /* Empty read buffers of BUFFER_SIZE bytes kept for reuse. */
+    char *free_read_bufs[MAX_FREE_READ_BUFFERS];
+    /* Number of buffers in free_read_bufs. */
+    unsigned int nr_free_read_bufs;
+    /* Doubly-linked list of connections with queued output, in the order they became dirty. */
+    struct conn *dirty_head;
+    struct conn *dirty_tail;
+    /* Doubly-linked list of connections with a shared-memory ring. */
+    struct conn *ring_head;
+    /* Server settings. */
+    server_config_t config;
+    /* Persistent message log, or NULL if messages are not persisted. */
+    chat_log_t *log;
+    /* Sockets accepting client connections. */
+    listener_t listeners[MAX_LISTENERS];
+    /* Number of entries in listeners. */
+    unsigned int nr_listeners;
+    /* Socket listening for a successor to hand the server over to, or -1. */
+    int handoff_socket;
+    /* Idle checks of the connections. */
+    timer_wheel_t timers;
+    /* Number of connections with a backlog that are not paused; select does not wait while there are any. */
+    unsigned int nr_backlogged;
+    /* Closed connections waiting for zero-copy completions, and the timer polling them. */
+    struct zc_linger *zc_lingering;
+    chat_timer_t zc_linger_timer;
 
 }conn_pool_t;
 
 /*
- * Data structure to keep track of messages. Each message object holds one
- * complete line of message from a client.
+ * Data structure to keep track of a chat room. Messages are only delivered to the
+ * members of the sender's room, so the cost of a broadcast is proportional to the
+ * size of the room rather than the number of connections on the server.
+ */
+typedef struct room {
+    /* Name of the room, as given to the JOIN command. */
+    char name[ROOM_NAME_SIZE];
+    /* Dynamically allocated array of the connections currently in this room. */
+    struct conn **members;
+    /* Number of connections in the members array. */
+    unsigned int nr_members;
+    /* Allocated size of the members array. */
+    unsigned int capacity;
+    /*
+     * Ring buffer of the most recent broadcasts in this room, allocated on the first
+     * broadcast. Message number n is stored in slot n % history_capacity.
+     */
+    payload_t **history;
+    /* Number of slots in the history ring. */
+    unsigned int history_capacity;
+    /* Number of messages ever added to the history. */
+    uint64_t history_count;
+}room_t;
+
+/*
+ * Data structure to keep track of outgoing data. Each message object is a chunk
+ * holding one or more complete messages for a client.
  *
  * The message objects are maintained per connection in a doubly-linked list.
  * When a message is read from one connection, it is added to the list of all other connections.
+ * Small messages are coalesced into the last chunk of the list while it has room, so
+ * the queue holds a few large contiguous buffers rather than one node per message.
  *
  * A message is added to the list only when a complete line has been read from
  * the client.
@@ -53,10 +415,19 @@ typedef struct msg {
     struct msg *prev;
     /* Points to the next message object in the doubly-linked list. */
     struct msg *next;
-    /* Points to a dynamically allocated buffer holding the message. */
+    /* Points to a dynamically allocated buffer holding the messages. */
     char *message;
-    /* Size of the message. */
+    /* Number of bytes of the buffer in use. */
     int size;
+    /* Allocated size of the buffer. */
+    int capacity;
+    /* Number of bytes at the start of the buffer already written to the client. */
+    int offset;
+    /*
+     * Shared payload this chunk refers to, or NULL if the chunk owns its buffer. A shared
+     * chunk's message points into the payload and is never coalesced into.
+     */
+    payload_t *payload;
 }msg_t;
 
 
@@ -79,6 +450,70 @@ typedef struct conn {
      */
     struct msg *write_msg_head;
     struct msg *write_msg_tail;
+    /* Id of the room this connection is currently in. */
+    int room;
+    /* Position of this connection in its room's members array. */
+    unsigned int room_index;
+    /* Room history count when this connection joined its room; replays stop there. */
+    uint64_t history_mark;
+    /*
+     * Input left over after the last read: an incomplete message, and complete ones beyond
+     * the read budget. NULL while there is none; points into the pool's batch buffer while
+     * the input is being handled.
+     */
+    char *read_buf;
+    /* Number of bytes currently held in read_buf. */
+    int read_len;
+    /* Allocated size of read_buf. */
+    int read_cap;
+    /* Protocol spoken by this connection (PROTO_*). */
+    int protocol;
+    /* Non-zero for a SOCK_SEQPACKET socket, where every read and write is a single packet. */
+    int seqpacket;
+    /* Registered nickname, or an empty string if none was registered. */
+    char nick[NICK_SIZE];
+    /* Next connection in the same bucket of the nickname hash table. */
+    struct conn *nick_next;
+    /* Non-zero while this connection is linked into the pool's dirty list. */
+    int dirty;
+    /* Links of the pool's dirty list. */
+    struct conn *dirty_prev;
+    struct conn *dirty_next;
+    /* Shared-memory ring the producer sends messages through, or NULL. */
+    shm_ring_t *ring;
+    /* Links of the pool's list of connections with a ring. */
+    struct conn *ring_prev;
+    struct conn *ring_next;
+    /* Non-zero once the socket buffer filled up, until select reports the socket writable. */
+    int write_blocked;
+    /* Bytes of output waiting in the write queue. */
+    size_t queued_bytes;
+    /* Set when the write queue would exceed max_queue_bytes; the flush phase closes the connection. */
+    int overflowed;
+    /* Non-zero if SO_ZEROCOPY is enabled on the socket. */
+    int zerocopy;
+    /* Sequence number the kernel will assign to the next zero-copy send. */
+    uint32_t zc_next_seq;
+    /* List of zero-copy sends awaiting completion, oldest first. */
+    struct zc_pending *zc_head;
+    struct zc_pending *zc_tail;
+    /* Time of the last input, in milliseconds of the pool's timer wheel. */
+    long long last_active;
+    /* Non-zero if a FRAME_PING was sent since the last input. */
+    int ping_sent;
+    /* Fires when the connection is due to be pinged or closed for idleness. */
+    chat_timer_t idle_timer;
+    /* Rate limits of the connection's input. */
+    token_bucket_t msg_bucket;
+    token_bucket_t byte_bucket;
+    /* Messages sent in the current second, for the rate tag transform. */
+    transform_rate_t rate_tag;
+    /* Non-zero while reading is paused because a bucket is overdrawn. */
+    int read_paused;
+    /* Fires when the overdrawn buckets have refilled and reading can resume. */
+    chat_timer_t rate_timer;
+    /* Non-zero if the read buffer holds complete messages left over by the read budget. */
+    int backlogged;
 }conn_t;
 
 /**
@@ -98,6 +533,106 @@ typedef struct conn {
  */
 msg_t* createMessage(const char* buffer, int len);
 
+/**
+ * Allocates a new msg_t structure holding the concatenation of several buffers.
+ * This works like createMessage, but gathers the content from an array of iovec
+ * structures so that a message can be built from a header and a body without an
+ * intermediate copy.
+ *
+ * @param iov: The buffers to concatenate.
+ * @param iovcnt: The number of buffers in iov.
+ * @return
+ *   - A pointer to the newly created msg_t structure if the function succeeds.
+ *   - NULL if memory allocation fails.
+ */
+msg_t* createMessageIov(const struct iovec* iov, int iovcnt);
+
+/**
+ * Encodes a binary protocol frame header.
+ *
+ * @param out: Buffer of at least FRAME_HEADER_SIZE bytes receiving the header.
+ * @param type: The frame type (FRAME_*).
+ * @param room: The room id the frame refers to.
+ * @param length: The length of the payload following the header.
+ */
+void encodeFrameHeader(char* out, int type, int room, uint32_t length);
+
+/**
+ * Decodes a binary protocol frame header.
+ *
+ * @param in: Buffer of at least FRAME_HEADER_SIZE bytes holding the header.
+ * @param header: Receives the decoded header fields.
+ */
+void decodeFrameHeader(const char* in, frame_header_t* header);
+
+/**
+ * Fills a server_config_t structure with the default settings.
+ *
+ * @param config: A pointer to the server_config_t structure to initialize.
+ */
+void initConfig(server_config_t* config);
+
+/**
+ * Parses socket options given on the command line: a comma-separated list of
+ * name=value pairs among nodelay, sndbuf, rcvbuf, notsent_lowat, busy_poll,
+ * defer_accept and backlog. A name without a value sets the option to 1.
+ *
+ * @param spec: The NUL-terminated option list.
+ * @param config: Receives the options.
+ * @return
+ *   - 0 on success.
+ *   - -1 if an option is unknown or its value is not a non-negative integer.
+ */
+int parseSocketOptions(const char* spec, server_config_t* config);
+
+/**
+ * Parses a verbosity level given by name: "quiet", "info" or "debug".
+ *
+ * @param name: The NUL-terminated level name.
+ * @param verbosity: Receives the level (VERBOSITY_*).
+ * @return
+ *   - 0 on success.
+ *   - -1 if the name is unknown.
+ */
+int parseVerbosity(const char* name, int* verbosity);
+
+/**
+ * Reads settings from a configuration file into a server_config_t structure. Each line
+ * holds a "key = value" pair; blank lines and lines starting with '#' are ignored. The
+ * keys are direct_write, zerocopy_threshold, history_size, log_sync, drain_timeout,
+ * idle_timeout and ping_interval (in seconds), rate_msgs, rate_bytes, read_budget,
+ * max_queue_bytes, verbosity, transforms (see parseTransforms), and the socket options of
+ * parseSocketOptions. Settings the file leaves out keep their current values. Nothing is
+ * changed if the file has an error.
+ *
+ * When reloading, a setting that only takes effect at startup (the history size, the log
+ * sync policy, the transforms and the socket options) keeps its current value, with a
+ * warning if the file changes it.
+ *
+ * @param path: The path of the configuration file.
+ * @param config: The settings to update.
+ * @param reload: Non-zero if the server is already running with config.
+ * @return
+ *   - 0 on success.
+ *   - -1 if the file cannot be read or has an invalid line.
+ */
+int loadConfigFile(const char* path, server_config_t* config, int reload);
+
+/**
+ * Reloads the configuration file of a running server and applies the new settings
+ * without dropping any connection. The idle checks of all connections are rescheduled
+ * for the new timeouts; rate limits, the read budget, the queue limit and the verbosity
+ * apply from the next message on. A changed rate limit gives every connection a full
+ * bucket, and paused connections are checked again against the new limit.
+ *
+ * @param pool: A pointer to the conn_pool_t structure of the running server.
+ * @param path: The path of the configuration file.
+ * @return
+ *   - 0 if the settings were reloaded.
+ *   - -1 if the file could not be loaded; the current settings are kept.
+ */
+int reloadConfig(conn_pool_t* pool, const char* path);
+
 /**
  * Initializes a connection pool structure. This function sets up the initial state
  * of the conn_pool_t structure by setting the maxfd to -1 (indicating that no file descriptors
@@ -114,6 +649,41 @@ msg_t* createMessage(const char* buffer, int len);
  */
 int initPool(conn_pool_t* pool);
 
+/**
+ * Releases the resources owned by a connection pool that are not tied to a single
+ * connection, such as the rooms, their member arrays and their histories. All connections should be
+ * removed from the pool before calling this function.
+ *
+ * @param pool: A pointer to the conn_pool_t structure to release.
+ */
+void destroyPool(conn_pool_t* pool);
+
+/**
+ * Returns the id of the room with the given name, creating the room if it does not
+ * exist yet. Room names are compared case-insensitively.
+ *
+ * @param pool: A pointer to the conn_pool_t structure owning the rooms.
+ * @param name: The NUL-terminated name of the room.
+ * @return
+ *   - The id of the room on success.
+ *   - -1 if the name is invalid, the room table is full or memory allocation fails.
+ */
+int findOrCreateRoom(conn_pool_t* pool, const char* name);
+
+/**
+ * Moves a connection from its current room to another room. The connection is
+ * removed from the members array of its current room and appended to the members
+ * array of the new room.
+ *
+ * @param conn: A pointer to the connection to move.
+ * @param room: The id of the room to join.
+ * @param pool: A pointer to the conn_pool_t structure owning the rooms.
+ * @return
+ *   - 0 on success.
+ *   - -1 if the room id is invalid or memory allocation fails.
+ */
+int joinRoom(conn_t* conn, int room, conn_pool_t* pool);
+
 // Signal handler to gracefully terminate the server
 void intHandler(int SIG_INT);
 
@@ -132,65 +702,186 @@ void freeMessagesInQueue(conn_t* conn);
 /**
  * Updates the maximum file descriptor (maxfd) value in the connection pool. This function
  * iterates through all active connections in the pool to find the highest socket descriptor
- * value and sets the pool's maxfd to the maximum of these values or the welcome socket's
- * descriptor, whichever is higher. This is necessary to ensure the select() call in the main
- * loop correctly monitors all active file descriptors, including the welcome socket for
- * accepting new connections and all client sockets for reading and writing.
+ * value and sets the pool's maxfd to the maximum of these values or the descriptors of the
+ * listening sockets (or the handoff socket), whichever is higher. This is necessary to ensure
+ * the select() call in the main loop correctly monitors all active file descriptors, including
+ * the listening sockets for accepting new connections and all client sockets for reading and
+ * writing.
  *
  * @param pool: A pointer to the conn_pool_t structure representing the current state of active
  *              connections and their management.
- * @param welcome_socket: The socket descriptor of the server's welcome socket. This descriptor
- *                        is used as a baseline for the maximum descriptor value since it must
- *                        always be included in the set of descriptors monitored by select().
  */
-void updateMaxFd(conn_pool_t* pool, int welcome_socket);
+void updateMaxFd(conn_pool_t* pool);
+
+/**
+ * Clears a Unix socket path for bind. A socket file that nothing listens on any more,
+ * which connect() refuses, is removed. Anything else at the path is left alone: a file
+ * that is not a socket, or a socket that a running server still accepts on.
+ *
+ * @param path: The NUL-terminated socket path.
+ * @param type: The socket type that will be bound (SOCK_STREAM or SOCK_SEQPACKET).
+ * @return
+ *   - 0 if nothing is left at the path.
+ *   - -1, after reporting why, if the path is in use or cannot be checked.
+ */
+int removeStaleSocket(const char* path, int type);
+
+/**
+ * Creates a listening socket for an address, binds it and adds it to the pool's listeners
+ * and read set. The address is one of:
+ *   - port: any IPv4 address, as the server has always listened on.
+ *   - host:port: an IPv4 address or a host name, or * for any IPv4 address.
+ *   - [address]:port: an IPv6 address; [::] accepts IPv4 clients as well (dual stack).
+ *   - unix:path: a Unix stream socket, replacing a stale socket file left at the path (see
+ *     removeStaleSocket).
+ *   - unixpacket:path: a Unix SOCK_SEQPACKET socket. The chat protocol runs over it as over
+ *     a stream, so messages may span packets; packets are at most MAX_SEQPACKET_SIZE bytes.
+ *   - shm:path: a Unix stream socket whose connections are each given a shared-memory ring
+ *     (see chatShm.h) to send messages through.
+ * The configured socket options are applied to the new socket; an option the kernel rejects
+ * is an error, so that a misconfiguration shows at startup rather than on every connection.
+ *
+ * @param pool: A pointer to the conn_pool_t structure whose settings and listeners are used.
+ * @param address: The NUL-terminated address to listen on.
+ * @return
+ *   - 0 on success.
+ *   - -1 if the address is invalid, the socket cannot be set up or there are MAX_LISTENERS listeners.
+ */
+int addListener(conn_pool_t* pool, const char* address);
+
+/**
+ * Adds a socket that is already listening, such as one taken over from a previous server,
+ * to the pool's listeners and read set.
+ *
+ * @param pool: A pointer to the conn_pool_t structure receiving the listener.
+ * @param fd: The listening socket.
+ * @param family: The address family of the socket.
+ * @param type: The socket type.
+ * @param shm: Non-zero to give accepted connections a shared-memory ring.
+ * @param path: The path of a Unix socket, or NULL.
+ * @return
+ *   - 0 on success.
+ *   - -1 if there are MAX_LISTENERS listeners already; the socket is left open.
+ */
+int registerListener(conn_pool_t* pool, int fd, int family, int type, int shm, const char* path);
+
+/**
+ * Attaches a shared-memory ring to a connection and watches the ring's eventfd. The
+ * records the producer appends are handled like lines of text from the connection.
+ *
+ * @param conn: The connection.
+ * @param ring: The mapped ring; the connection takes it over, also on failure.
+ * @param pool: A pointer to the conn_pool_t structure owning the connection.
+ * @return
+ *   - 0 on success.
+ *   - -1 if memory allocation fails; the ring is closed.
+ */
+int setConnRing(conn_t* conn, shm_ring_t* ring, conn_pool_t* pool);
 
 /**
- * Initializes the server by creating a welcome socket, setting it to non-blocking mode,
- * and binding it to the specified port. This function sets up the server's listening
- * environment, making it ready to accept incoming connections.
+ * Handles the records in the connections' shared-memory rings, up to the read budget
+ * per connection. Called right after select, before the descriptors are scanned: ready
+ * eventfds are taken out of ready_read_set and nready here. Connections whose reading
+ * is paused by the rate limits are skipped, and a connection whose ring is corrupt is
+ * removed.
  *
- * @param port: The port number on which the server will listen for incoming connections.
- * @return: The socket descriptor of the welcome socket if successful, or -1 on failure.
+ * @param pool: A pointer to the conn_pool_t structure representing the current state of active
+ *              connections.
  */
-int initializeServer(in_port_t port);
+void pollShmRings(conn_pool_t* pool);
 
 /**
- * Capitalizes all alphabetic characters in a given string. This function iterates
- * through each character of the string, converting it to its uppercase equivalent
- * if it is an alphabetic character.
+ * Prepares the shared-memory rings for select: asks their producers to signal the next
+ * record, and checks whether any ring still holds records to handle.
  *
- * @param message: The string to be capitalized. This string is modified in place.
- * @param length: The length of the string.
+ * @param pool: A pointer to the conn_pool_t structure representing the current state of active
+ *              connections.
+ * @return: Non-zero if select must not wait, because a ring has records pending.
  */
-void capitalizeMessage(char* message, int length);
+int armShmRings(conn_pool_t* pool);
 
 /**
- * Accepts a new connection on the welcome socket and adds it to the connection pool.
+ * Closes the pool's listening sockets, so that no more connections are accepted.
+ *
+ * @param pool: A pointer to the conn_pool_t structure owning the listeners.
+ * @param unlink_paths: Non-zero to remove the socket files of Unix listeners; a server that
+ *                      was handed over leaves them to its successor.
+ */
+void closeListeners(conn_pool_t* pool, int unlink_paths);
+
+/**
+ * Applies the configured socket options (TCP_NODELAY, buffer sizes, TCP_NOTSENT_LOWAT,
+ * SO_BUSY_POLL) to a socket. Options left at 0 are not touched, and the TCP options are
+ * not applied to Unix sockets. Every option is tried even if an earlier one fails.
+ *
+ * @param sd: The socket descriptor.
+ * @param family: The address family of the socket.
+ * @param config: The server settings with the socket options.
+ * @return
+ *   - 0 if every configured option was set.
+ *   - -1 if an option could not be set.
+ */
+int tuneSocket(int sd, int family, const server_config_t* config);
+
+/**
+ * Registers a nickname for a connection, replacing its previous nickname if it had one.
+ * Nicknames are unique and compared case-insensitively; they are stored in a hash table
+ * so that private messages can find their recipient without scanning the connection list.
+ *
+ * @param conn: A pointer to the connection registering the nickname.
+ * @param nick: The NUL-terminated nickname.
+ * @param pool: A pointer to the conn_pool_t structure owning the nickname table.
+ * @return
+ *   - 0 on success.
+ *   - -1 if the nickname is invalid or already registered by another connection.
+ */
+int setNick(conn_t* conn, const char* nick, conn_pool_t* pool);
+
+/**
+ * Looks up the connection that registered a nickname.
+ *
+ * @param pool: A pointer to the conn_pool_t structure owning the nickname table.
+ * @param nick: The NUL-terminated nickname to look up.
+ * @return: A pointer to the connection, or NULL if no connection registered the nickname.
+ */
+conn_t* findConnByNick(conn_pool_t* pool, const char* nick);
+
+/**
+ * Accepts a new connection on a listening socket and adds it to the connection pool.
  * If a new connection is successfully established, it also updates the maximum file
  * descriptor value in the pool.
  *
- * @param welcome_socket: The socket descriptor of the server's welcome socket.
+ * @param listen_socket: The listening socket that is ready to accept.
  * @param pool: A pointer to the conn_pool_t structure representing the current state of active connections.
  */
-int acceptNewConnection(int welcome_socket, conn_pool_t* pool);
+int acceptNewConnection(int listen_socket, conn_pool_t* pool);
 
 /**
- * Reads data from an active connection, capitalizes it, and then broadcasts
- * the message to other connections. If the connection is closed, it removes
- * the connection from the pool and updates the maxfd accordingly.
+ * Reads data from an active connection. The first bytes a connection sends decide its
+ * protocol. Text connections are split into complete lines: lines starting with '/' are
+ * handled as commands (/join <room>, /leave, /nick <name>, /msg <nick> <text>), other
+ * lines are capitalized and broadcast to the other members of the sender's room. Binary
+ * connections are split into frames whose payloads are forwarded untouched. Incomplete
+ * trailing data is kept in the connection's read buffer until the rest arrives. At most
+ * read_budget messages are handled per call; complete messages beyond the budget stay in
+ * the read buffer, the connection is marked backlogged, and the next call handles them
+ * instead of reading from the socket. While a read fills the batch buffer and the budget
+ * lasts, the socket is read again, up to MAX_READS_PER_EVENT times, so a client with a lot
+ * of pending input is served in one call. A SOCK_SEQPACKET socket yields one packet per
+ * read; a packet that does not fit in the batch buffer is a protocol violation. If the
+ * connection is closed or violates the
+ * protocol, it removes the connection from the pool and updates the maxfd accordingly.
  *
  * @param sd: The socket descriptor of the connection to read from.
  * @param pool: A pointer to the conn_pool_t structure for managing active connections.
- * @param welcome_socket: The socket descriptor of the server's welcome socket for maxfd calculation.
  */
-void processDataFromConnection(int sd, conn_pool_t* pool, int welcome_socket);
+void processDataFromConnection(int sd, conn_pool_t* pool);
 
 /**
  * Adds a new client connection to the connection pool. This function dynamically allocates memory
  * for a new conn_t structure to represent the client connection identified by the socket descriptor 'sd'.
  * It initializes this structure, sets it as the new head of the doubly linked list of connections within
- * the pool, and updates the file descriptor sets and maximum file descriptor value as necessary.
+ * the pool, places the connection in the lobby, and updates the file descriptor sets as necessary.
  * The connection pool is used to manage active client connections and facilitate select-based multiplexing
  * for handling I/O operations.
  *
@@ -206,9 +897,12 @@ int addConn(int sd, conn_pool_t* pool);
 /**
  * Removes a client connection from the connection pool. This function finds the conn_t
  * structure associated with the given socket descriptor (sd) in the pool's linked list of
- * connections, frees all queued messages, removes the connection from the list, and updates
+ * connections, frees all queued messages, removes the connection from the list, its room and the
+ * nickname table, and updates
  * the pool's file descriptor sets and maxfd value as necessary. It also closes the socket
- * descriptor and frees the conn_t structure.
+ * descriptor and frees the conn_t structure. If zero-copy sends from the socket have not
+ * completed, the socket is shut down instead and closed once they have, so that their
+ * payloads are not freed while the kernel may still read them.
  *
  * @param sd: The socket descriptor of the connection to remove.
  * @param pool: A pointer to the connection pool (conn_pool_t structure) from which the
@@ -221,33 +915,215 @@ int addConn(int sd, conn_pool_t* pool);
 int removeConn(int sd, conn_pool_t* pool);
 
 /**
- * Distributes a message to all active connections in the connection pool, except for the sender.
+ * Allocates a shared payload holding a message encoded for both protocols, with a
+ * reference count of 1 owned by the caller.
+ *
+ * @param type: The frame type used for binary recipients (FRAME_*).
+ * @param room: The room id used for binary recipients.
+ * @param buffer: A pointer to the message body, without a line terminator.
+ * @param len: The length of the message body in bytes.
+ * @return: A pointer to the new payload, or NULL if memory allocation fails.
+ */
+payload_t* createPayload(int type, int room, const char* buffer, int len);
+
+/**
+ * Drops a reference to a shared payload, freeing it when the last reference is gone.
+ *
+ * @param payload: The payload to release, or NULL.
+ */
+void releasePayload(payload_t* payload);
+
+/**
+ * Appends a reference to a shared payload to the write queue of a single connection,
+ * without copying the payload, and marks the connection as having output to flush.
+ * The queued bytes are the payload's encoding for the connection's protocol.
+ *
+ * @param conn: A pointer to the connection whose write queue receives the payload.
+ * @param payload: The payload to queue. A new reference is taken.
+ * @param pool: A pointer to the conn_pool_t structure owning the connection.
+ * @return
+ *   - 0 on success.
+ *   - -1 if memory allocation fails.
+ */
+int enqueuePayload(conn_t* conn, payload_t* payload, conn_pool_t* pool);
+
+/**
+ * Queues the history of a connection's room for the connection: the messages broadcast
+ * in the room before the connection joined it, oldest first, as far back as the room's
+ * history reaches. The messages are queued as references to their shared payloads, so
+ * the whole history goes out in a few vectored writes without copying the bodies.
+ *
+ * @param conn: A pointer to the connection receiving the history.
+ * @param pool: A pointer to the conn_pool_t structure owning the rooms.
+ * @return
+ *   - 0 on success.
+ *   - -1 if memory allocation fails.
+ */
+int replayHistory(conn_t* conn, conn_pool_t* pool);
+
+/**
+ * Refills the room histories from the tail of the message log after a restart, creating
+ * the rooms named in the log. Does nothing unless the pool has a log and a history size.
+ *
+ * @param pool: A pointer to the conn_pool_t structure owning the rooms and the log.
+ * @return
+ *   - 0 on success.
+ *   - -1 if the log cannot be read.
+ */
+int restoreHistory(conn_pool_t* pool);
+
+/**
+ * Releases the payloads of the zero-copy sends the kernel reports as completed on the
+ * connection's socket error queue. Completions make the socket readable, so this is
+ * called before reading from a connection with pending zero-copy sends, and also before
+ * writing to it and while its reading is paused.
+ *
+ * @param conn: A pointer to the connection whose completions are processed.
+ */
+void reapZerocopyCompletions(conn_t* conn);
+
+/**
+ * Returns an output chunk to the pool's free list, or frees it if it is not a
+ * standard-sized chunk or the free list is full.
+ *
+ * @param pool: A pointer to the conn_pool_t structure owning the free list.
+ * @param chunk: The chunk to release. It must not be linked into a write queue.
+ */
+void releaseChunk(conn_pool_t* pool, msg_t* chunk);
+
+/**
+ * Appends a message gathered from several buffers to the write queue of a single
+ * connection and marks the connection as ready for writing in the connection pool's
+ * write_set. The buffers are copied into the last chunk of the queue if it has room,
+ * otherwise into a new OUTPUT_CHUNK_SIZE chunk (or a larger one for big messages).
+ * With config.direct_write set and nothing queued for the connection, the message is first
+ * sent directly on the socket and only the part the socket did not accept is queued.
+ *
+ * @param conn: A pointer to the connection whose write queue receives the message.
+ * @param iov: The buffers making up the message.
+ * @param iovcnt: The number of buffers in iov.
+ * @param pool: A pointer to the conn_pool_t structure owning the connection.
+ * @return
+ *   - 0 on success.
+ *   - -1 if memory allocation for the message fails.
+ */
+int enqueueIov(conn_t* conn, const struct iovec* iov, int iovcnt, conn_pool_t* pool);
+
+/**
+ * Queues a message for a single connection, encoded for the connection's protocol:
+ * text connections get the body followed by a newline, binary connections get a frame
+ * of the given type and room.
+ *
+ * @param conn: A pointer to the recipient connection.
+ * @param type: The frame type used for binary connections (FRAME_*).
+ * @param room: The room id used for binary connections.
+ * @param body: The message body, without a line terminator.
+ * @param len: The length of the body in bytes.
+ * @param pool: A pointer to the conn_pool_t structure owning the connection.
+ * @return
+ *   - 0 on success.
+ *   - -1 if memory allocation for the message fails.
+ */
+int deliverMessage(conn_t* conn, int type, int room, const char* body, int len, conn_pool_t* pool);
+
+/**
+ * Appends a copy of a message to the write queue of a single connection and marks the
+ * connection as ready for writing in the connection pool's write_set. The bytes are
+ * queued as is, without any protocol encoding.
+ *
+ * @param conn: A pointer to the connection whose write queue receives the message.
+ * @param buffer: A pointer to the character array containing the message.
+ * @param len: The length of the message in bytes.
+ * @param pool: A pointer to the conn_pool_t structure owning the connection.
+ * @return
+ *   - 0 on success.
+ *   - -1 if memory allocation for the message fails.
+ */
+int enqueueMessage(conn_t* conn, const char* buffer, int len, conn_pool_t* pool);
+
+/**
+ * Distributes a message to all members of a room, except for the sender. For each member,
+ * this function appends a copy of the message to the member's write queue, encoded for
+ * the member's protocol (see deliverMessage). A member whose protocol is not known yet
+ * holds the message as a shared payload until it is (see PROTOCOL_WAIT_MS). Messages of
+ * at least config.zerocopy_threshold
+ * bytes are stored once in a shared payload that every member's queue references. With
+ * config.history_size set, the message is also added to the room's history, and with a
+ * message log it is appended to the log.
+ *
+ * @param sd: The socket descriptor of the sender, which does not receive its own message.
+ * @param room: The id of the room whose members receive the message.
+ * @param buffer: A pointer to the message body, without a line terminator.
+ * @param len: The length of the message body in bytes.
+ * @param pool: A pointer to the conn_pool_t structure representing the current state of active
+ *              connections and their write queues.
+ * @return
+ *   - 0 on successful distribution of the message.
+ *   - -1 if the provided pool pointer is NULL or the room id is invalid.
+ */
+int addMsgToRoom(int sd, int room, char* buffer, int len, conn_pool_t* pool);
+
+/**
+ * Distributes a message to all connections in the sender's room, except for the sender.
  * For each connection, this function creates a new msg_t structure containing a copy of the given
  * message, then appends this message to the end of the connection's write queue. It ensures that
  * the message will be sent to each client by marking the connection as ready for writing in the
- * connection pool's write_set.
+ * connection pool's write_set. Messages from a descriptor that is not a client connection are
+ * distributed to the lobby.
  *
  * @param sd: The socket descriptor of the sender. The message will not be added to the sender's
  *            write queue to avoid echoing the message back to the sender.
- * @param buffer: A pointer to the character array containing the message to be distributed.
- * @param len: The length of the message in bytes, indicating how much data from the buffer should
- *             be copied into each new message structure.
+ * @param buffer: A pointer to the message body to be distributed, without a line terminator.
+ * @param len: The length of the message body in bytes, indicating how much data from the buffer
+ *             should be copied into each new message structure.
  * @param pool: A pointer to the conn_pool_t structure representing the current state of active
  *              connections and their write queues.
  * @return
- *   - 0 on successful distribution of the message to all connections except the sender.
+ *   - 0 on successful distribution of the message to all connections in the room except the sender.
  *   - -1 if the provided pool pointer is NULL, indicating an error.
  */
 int addMsg(int sd,char* buffer,int len,conn_pool_t* pool);
 
 
 /**
- * Writes all queued messages for a specific client connection to the client. This function
- * iterates through the write queue of messages for the connection identified by the socket
- * descriptor (sd), writing each message to the client. After a message has been successfully
- * written, it is removed from the queue and its memory is freed. If all messages are successfully
- * written and the queue becomes empty, the connection's descriptor is removed from the write set
- * to indicate that there is no more data pending to be sent to this client.
+ * Flushes the write queues of the connections that have pending output. This is called
+ * once per iteration of the main loop, after all reads have been processed, so that every
+ * message queued during the iteration is combined into as few writes as possible. Each
+ * dirty connection is written once; connections whose socket buffer was full are skipped
+ * until select reports them writable again. Connections that fail to write are removed.
+ *
+ * @param pool: A pointer to the conn_pool_t structure representing the current state of active
+ *              connections and their write queues.
+ */
+void flushPendingWrites(conn_pool_t* pool);
+
+/**
+ * Advances the pool's timer wheel to the current time and runs the connections' due
+ * timers. Idle checks close connections without input for the idle timeout and send a
+ * FRAME_PING to binary connections without input for the ping interval; input only
+ * records its time, so the idle check of a busy connection is rescheduled when it fires
+ * rather than on every read. Rate timers resume reading from connections whose token
+ * buckets have refilled. Called right after select, before any read, so that connections
+ * in ready_read_set count as active.
+ *
+ * @param pool: A pointer to the conn_pool_t structure representing the current state of active
+ *              connections.
+ */
+void runTimers(conn_pool_t* pool);
+
+/**
+ * Writes queued messages for a specific client connection to the client. This function
+ * gathers the chunks in the write queue of the connection identified by the socket
+ * descriptor (sd) into vectored writes, writing as much as the socket accepts. After a chunk
+ * has been completely written, it is removed from the queue and released; a partially
+ * written chunk remembers how much was sent. On sockets with SO_ZEROCOPY enabled, shared
+ * payload chunks are sent on their own with MSG_ZEROCOPY and stay referenced until the
+ * kernel reports the send as completed. On SOCK_SEQPACKET sockets a write sends at most
+ * MAX_SEQPACKET_SIZE bytes, as one packet. If the queue becomes empty, the connection's
+ * descriptor is removed from the write set and the connection leaves the pool's dirty list
+ * to indicate that there is no more data pending to be sent to this client. Otherwise the
+ * socket buffer is full: the descriptor is added to the write set and the connection is
+ * marked as blocked until select reports it writable.
  *
  * @param sd: The socket descriptor of the connection for which messages are to be written.
  * @param pool: A pointer to the conn_pool_t structure representing the current state of active
@@ -256,7 +1132,8 @@ int addMsg(int sd,char* buffer,int len,conn_pool_t* pool);
  *   - 0 on success, indicating that messages were written to the client or there were no messages
  *     to write.
  *   - -1 on failure, indicating an invalid pool pointer was provided, the connection for the given
- *     socket descriptor was not found, or an error occurred during writing.
+ *     socket descriptor was not found, or an error occurred during writing. The connection should
+ *     be removed after a write error.
  */
 int writeToClient(int sd,conn_pool_t* pool);
 
@@ -0,0 +1,255 @@
+#define _GNU_SOURCE /* memfd_create */
+#include "chatShm.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+/*
+ * Space a record of len bytes takes in the ring.
+ */
+static uint32_t recordSize(uint32_t len)
+{
+    return (uint32_t)(sizeof(uint32_t) + len + SHM_RECORD_ALIGN - 1) & ~(uint32_t)(SHM_RECORD_ALIGN - 1);
+}
+
+/*
+ * Maps the ring held by a memfd of the given total size.
+ */
+static int mapShmRing(shm_ring_t* ring, size_t map_size)
+{
+    void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("Cannot map shared ring");
+        return -1;
+    }
+    ring->header = (shm_ring_header_t*)map;
+    ring->data = (char*)map + sizeof(shm_ring_header_t);
+    return 0;
+}
+
+int createShmRing(shm_ring_t* ring)
+{
+    size_t map_size = sizeof(shm_ring_header_t) + SHM_RING_SIZE;
+    ring->size = SHM_RING_SIZE;
+    ring->memfd = memfd_create("chat-ring", MFD_CLOEXEC);
+    ring->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->memfd < 0 || ring->eventfd < 0 || ftruncate(ring->memfd, (off_t)map_size) != 0)
+    {
+        perror("Cannot create shared ring");
+        if (ring->memfd >= 0)
+            close(ring->memfd);
+        if (ring->eventfd >= 0)
+            close(ring->eventfd);
+        return -1;
+    }
+    if (mapShmRing(ring, map_size) != 0)
+    {
+        close(ring->memfd);
+        close(ring->eventfd);
+        return -1;
+    }
+
+    // The memfd is zero-filled, so the positions and the waiting flag start at 0.
+    ring->header->magic = SHM_RING_MAGIC;
+    ring->header->size = SHM_RING_SIZE;
+    return 0;
+}
+
+int attachShmRing(shm_ring_t* ring, int memfd, int eventfd)
+{
+    ring->memfd = memfd;
+    ring->eventfd = eventfd;
+
+    // The size is only trusted once it matches the file.
+    struct stat st;
+    shm_ring_header_t header;
+    if (fstat(memfd, &st) != 0 || st.st_size < (off_t)sizeof(header) ||
+        pread(memfd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        header.magic != SHM_RING_MAGIC || header.size < SHM_RECORD_ALIGN || (header.size & (header.size - 1)) != 0 ||
+        st.st_size != (off_t)(sizeof(header) + header.size))
+    {
+        fprintf(stderr, "Invalid shared ring\n");
+        close(memfd);
+        close(eventfd);
+        return -1;
+    }
+
+    ring->size = header.size;
+    if (mapShmRing(ring, (size_t)st.st_size) != 0)
+    {
+        close(memfd);
+        close(eventfd);
+        return -1;
+    }
+    return 0;
+}
+
+void closeShmRing(shm_ring_t* ring)
+{
+    munmap(ring->header, sizeof(shm_ring_header_t) + ring->size);
+    close(ring->memfd);
+    close(ring->eventfd);
+    ring->header = NULL;
+    ring->data = NULL;
+}
+
+int sendShmRing(int sock, const shm_ring_t* ring)
+{
+    uint32_t magic = SHM_RING_MAGIC;
+    int fds[2] = { ring->memfd, ring->eventfd };
+    struct iovec iov = { &magic, sizeof(magic) };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(magic))
+    {
+        perror("Error sending shared ring");
+        return -1;
+    }
+    return 0;
+}
+
+int receiveShmRing(int sock, shm_ring_t* ring)
+{
+    uint32_t magic = 0;
+    int fds[2] = { -1, -1 };
+    struct iovec iov = { &magic, sizeof(magic) };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(sock, &msg, MSG_WAITALL);
+    struct cmsghdr* cmsg = received > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    if (received != (ssize_t)sizeof(magic) || magic != SHM_RING_MAGIC || fds[0] < 0 || fds[1] < 0)
+    {
+        fprintf(stderr, "The server did not send a shared ring\n");
+        if (fds[0] >= 0)
+            close(fds[0]);
+        if (fds[1] >= 0)
+            close(fds[1]);
+        return -1;
+    }
+    return attachShmRing(ring, fds[0], fds[1]);
+}
+
+int publishShmRecord(shm_ring_t* ring, const void* data, uint32_t len)
+{
+    if (len > SHM_MAX_RECORD)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    shm_ring_header_t* header = ring->header;
+    uint64_t tail = atomic_load_explicit(&header->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&header->head, memory_order_acquire);
+    uint32_t size = recordSize(len);
+    uint32_t offset = (uint32_t)(tail & (ring->size - 1));
+    uint32_t skip = ring->size - offset < size ? ring->size - offset : 0; // Records do not wrap
+    if (tail + skip + size - head > ring->size)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (skip > 0)
+    {
+        uint32_t wrap = SHM_RECORD_WRAP;
+        memcpy(ring->data + offset, &wrap, sizeof(wrap));
+        offset = 0;
+    }
+    memcpy(ring->data + offset, &len, sizeof(len));
+    memcpy(ring->data + offset + sizeof(len), data, len);
+    atomic_store_explicit(&header->tail, tail + skip + size, memory_order_release);
+
+    // Pairs with the fence in armShmRing: either the server sees the record before it
+    // sleeps, or this sees that it is waiting.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&header->waiting, memory_order_relaxed) &&
+        atomic_exchange_explicit(&header->waiting, 0, memory_order_relaxed))
+    {
+        uint64_t one = 1;
+        if (write(ring->eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            return -1;
+    }
+    return 0;
+}
+
+const char* peekShmRecord(shm_ring_t* ring, uint32_t* len)
+{
+    shm_ring_header_t* header = ring->header;
+    uint64_t head = atomic_load_explicit(&header->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&header->tail, memory_order_acquire);
+
+    while (head != tail)
+    {
+        // The producer is not trusted to stay within the ring.
+        uint32_t offset = (uint32_t)(head & (ring->size - 1));
+        uint32_t record_len;
+        if (tail - head > ring->size)
+            return SHM_RECORD_INVALID;
+        memcpy(&record_len, ring->data + offset, sizeof(record_len));
+
+        if (record_len == SHM_RECORD_WRAP)
+        {
+            head += ring->size - offset;
+            atomic_store_explicit(&header->head, head, memory_order_release);
+            continue;
+        }
+        if (record_len > SHM_MAX_RECORD || recordSize(record_len) > tail - head ||
+            offset + recordSize(record_len) > ring->size)
+            return SHM_RECORD_INVALID;
+
+        *len = record_len;
+        return ring->data + offset + sizeof(record_len);
+    }
+    return NULL;
+}
+
+void consumeShmRecord(shm_ring_t* ring, uint32_t len)
+{
+    uint64_t head = atomic_load_explicit(&ring->header->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->header->head, head + recordSize(len), memory_order_release);
+}
+
+int armShmRing(shm_ring_t* ring)
+{
+    shm_ring_header_t* header = ring->header;
+    atomic_store_explicit(&header->waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load_explicit(&header->tail, memory_order_acquire) !=
+           atomic_load_explicit(&header->head, memory_order_relaxed);
+}
+
+void disarmShmRing(shm_ring_t* ring, int signalled)
+{
+    atomic_store_explicit(&ring->header->waiting, 0, memory_order_relaxed);
+    uint64_t count;
+    if (signalled && read(ring->eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("Error reading shared ring event");
+}
@@ -0,0 +1,171 @@
+#ifndef CHAT_SHM_H
+#define CHAT_SHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Shared-memory ingestion channel for producers on the same host. The server creates a
+ * single-producer single-consumer ring in a memfd and an eventfd for each connection
+ * accepted on a shm listener, and passes both to the client with SCM_RIGHTS before
+ * anything else is sent on the socket. The producer maps the ring and appends records
+ * to it; the server drains the records in its event loop and handles each one as a
+ * line of text from the connection, without a read system call. The socket stays an
+ * ordinary text or binary connection for everything the producer receives; a record
+ * that arrives before any bytes on the socket makes it a text connection, so a binary
+ * producer sends the frame hello first.
+ *
+ * A record is a 32-bit length followed by the bytes of one message, padded to
+ * SHM_RECORD_ALIGN bytes. A record never wraps around the end of the ring: when it does
+ * not fit, the producer writes SHM_RECORD_WRAP and continues at the start. Positions are
+ * byte counts that only grow; the offset in the ring is the position modulo its size.
+ *
+ * The producer only signals the eventfd when the server announced that it is about to
+ * sleep in select, so a busy ring costs no system call on either side.
+ */
+
+/* Identifies a ring ("SHMR"). */
+#define SHM_RING_MAGIC 0x524D4853u
+/* Size of the record area of a ring; a power of two. */
+#define SHM_RING_SIZE (1 << 20)
+/* Records start at multiples of this many bytes. */
+#define SHM_RECORD_ALIGN 8
+/* Largest message a record may carry, the same as a line of text. */
+#define SHM_MAX_RECORD 4095
+/* Length marking the rest of the ring as unused; the next record is at the start. */
+#define SHM_RECORD_WRAP UINT32_MAX
+/* Returned by peekShmRecord for a corrupt ring. */
+#define SHM_RECORD_INVALID ((const char*)-1)
+
+/*
+ * Header at the start of the shared mapping, followed by the record area. The positions
+ * are on separate cache lines so that the producer and the consumer do not contend.
+ */
+typedef struct shm_ring_header {
+    uint32_t magic;
+    /* Size of the record area. */
+    uint32_t size;
+    /* Position of the next record to consume; written by the server only. */
+    _Alignas(64) _Atomic uint64_t head;
+    /* Position behind the last published record; written by the producer only. */
+    _Alignas(64) _Atomic uint64_t tail;
+    /* Non-zero while the server may sleep without looking at the ring. */
+    _Alignas(64) _Atomic uint32_t waiting;
+}shm_ring_header_t;
+
+/*
+ * One side's view of a ring.
+ */
+typedef struct shm_ring {
+    shm_ring_header_t *header;
+    /* Record area, header->size bytes. */
+    char *data;
+    uint32_t size;
+    /* Memory file holding the header and the record area. */
+    int memfd;
+    /* Signalled by the producer to wake the server. */
+    int eventfd;
+}shm_ring_t;
+
+/**
+ * Creates a ring of SHM_RING_SIZE bytes in a new memfd, with an eventfd to signal it.
+ *
+ * @param ring: The ring to initialize.
+ * @return
+ *   - 0 on success.
+ *   - -1 on failure.
+ */
+int createShmRing(shm_ring_t* ring);
+
+/**
+ * Maps an existing ring, as received from the server or from a previous server. Takes
+ * ownership of both descriptors, also on failure.
+ *
+ * @param ring: The ring to initialize.
+ * @param memfd: The memfd holding the ring.
+ * @param eventfd: The eventfd signalling the ring.
+ * @return
+ *   - 0 on success.
+ *   - -1 if the memfd does not hold a valid ring or cannot be mapped.
+ */
+int attachShmRing(shm_ring_t* ring, int memfd, int eventfd);
+
+/**
+ * Unmaps a ring and closes its descriptors.
+ *
+ * @param ring: The ring to close.
+ */
+void closeShmRing(shm_ring_t* ring);
+
+/**
+ * Sends a ring's descriptors over a connected Unix socket, in a single message.
+ *
+ * @param sock: The socket.
+ * @param ring: The ring to send.
+ * @return
+ *   - 0 on success.
+ *   - -1 on failure.
+ */
+int sendShmRing(int sock, const shm_ring_t* ring);
+
+/**
+ * Receives the descriptors sent by sendShmRing and maps the ring. This must be the
+ * first read on the socket.
+ *
+ * @param sock: The socket.
+ * @param ring: The ring to initialize.
+ * @return
+ *   - 0 on success.
+ *   - -1 on failure.
+ */
+int receiveShmRing(int sock, shm_ring_t* ring);
+
+/**
+ * Appends a record to the ring (producer side) and wakes the server if it is waiting.
+ *
+ * @param ring: The ring.
+ * @param data: The message.
+ * @param len: The length of the message, at most SHM_MAX_RECORD bytes.
+ * @return
+ *   - 0 on success.
+ *   - -1 if the ring is full (errno EAGAIN) or the message is too long (errno EMSGSIZE).
+ */
+int publishShmRecord(shm_ring_t* ring, const void* data, uint32_t len);
+
+/**
+ * Returns the next record of the ring (consumer side) without consuming it.
+ *
+ * @param ring: The ring.
+ * @param len: Set to the length of the record.
+ * @return: A pointer to the record in the ring, NULL if the ring is empty, or
+ *          SHM_RECORD_INVALID if the producer wrote a record that is out of bounds.
+ */
+const char* peekShmRecord(shm_ring_t* ring, uint32_t* len);
+
+/**
+ * Consumes the record returned by the last peekShmRecord, giving its space back to the
+ * producer.
+ *
+ * @param ring: The ring.
+ * @param len: The length of the record.
+ */
+void consumeShmRecord(shm_ring_t* ring, uint32_t len);
+
+/**
+ * Tells the producer that the server is about to sleep, so that its next record signals
+ * the eventfd, and checks the ring once more.
+ *
+ * @param ring: The ring.
+ * @return: Non-zero if records are pending and the server should not sleep.
+ */
+int armShmRing(shm_ring_t* ring);
+
+/**
+ * Stops asking the producer for signals once the server is awake.
+ *
+ * @param ring: The ring.
+ * @param signalled: Non-zero if select reported the eventfd readable; its counter is cleared.
+ */
+void disarmShmRing(shm_ring_t* ring, int signalled);
+
+#endif
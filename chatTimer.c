@@ -0,0 +1,145 @@
+#include "chatTimer.h"
+#include <stddef.h>
+#include <time.h>
+
+long long currentTimeMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void initTimerWheel(timer_wheel_t* wheel, long long now_ms)
+{
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+        wheel->slots[i].prev = wheel->slots[i].next = &wheel->slots[i];
+    for (int i = 0; i < TIMER_WHEEL_SLOTS / 64; i++)
+        wheel->occupied[i] = 0;
+    wheel->current = (uint64_t)(now_ms / TIMER_TICK_MS);
+    wheel->now_ms = now_ms;
+}
+
+void initTimer(chat_timer_t* timer, timer_callback_t callback, void* data)
+{
+    timer->prev = timer->next = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->data = data;
+}
+
+/*
+ * Links a timer into the slot of its expiry tick.
+ */
+static void linkTimer(timer_wheel_t* wheel, chat_timer_t* timer)
+{
+    unsigned int slot = (unsigned int)(timer->expires & TIMER_WHEEL_MASK);
+    chat_timer_t* head = &wheel->slots[slot];
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+    wheel->occupied[slot / 64] |= 1ull << (slot % 64);
+}
+
+void scheduleTimer(timer_wheel_t* wheel, chat_timer_t* timer, long long delay_ms)
+{
+    cancelTimer(timer);
+
+    if (delay_ms < 0)
+        delay_ms = 0;
+    uint64_t expires = (uint64_t)((wheel->now_ms + delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+    // The current tick has been processed already.
+    timer->expires = expires > wheel->current ? expires : wheel->current + 1;
+    linkTimer(wheel, timer);
+}
+
+void cancelTimer(chat_timer_t* timer)
+{
+    if (!timer->next)
+        return;
+
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+}
+
+int timerPending(const chat_timer_t* timer)
+{
+    return timer->next != NULL;
+}
+
+long long nextTimerTimeout(timer_wheel_t* wheel)
+{
+    // Look for the first non-empty slot after the current tick, a bitmap word at a time.
+    for (unsigned int i = 1; i <= TIMER_WHEEL_SLOTS; )
+    {
+        unsigned int slot = (unsigned int)((wheel->current + i) & TIMER_WHEEL_MASK);
+        uint64_t bits = wheel->occupied[slot / 64] >> (slot % 64);
+        if (bits == 0)
+        {
+            i += 64 - slot % 64;
+            continue;
+        }
+
+        unsigned int skip = (unsigned int)__builtin_ctzll(bits);
+        i += skip;
+        slot += skip;
+        if (i > TIMER_WHEEL_SLOTS)
+            break;
+
+        chat_timer_t* head = &wheel->slots[slot];
+        if (head->next == head)
+        {
+            // Its timers were cancelled.
+            wheel->occupied[slot / 64] &= ~(1ull << (slot % 64));
+            i++;
+            continue;
+        }
+
+        long long timeout = (long long)(wheel->current + i) * TIMER_TICK_MS - wheel->now_ms;
+        return timeout > 0 ? timeout : 0;
+    }
+
+    return -1;
+}
+
+void advanceTimers(timer_wheel_t* wheel, long long now_ms, void* arg)
+{
+    uint64_t now = (uint64_t)(now_ms / TIMER_TICK_MS);
+    wheel->now_ms = now_ms;
+    if (now <= wheel->current)
+        return;
+
+    // After a full revolution every slot has been visited once; all due timers have fired.
+    uint64_t last = now - wheel->current > TIMER_WHEEL_SLOTS ? wheel->current + TIMER_WHEEL_SLOTS : now;
+    while (wheel->current < last)
+    {
+        wheel->current++;
+        unsigned int slot = (unsigned int)(wheel->current & TIMER_WHEEL_MASK);
+        chat_timer_t* head = &wheel->slots[slot];
+        if (head->next == head)
+            continue;
+
+        // Detach the slot's timers so the callbacks can schedule into it safely.
+        chat_timer_t pending;
+        pending.next = head->next;
+        pending.prev = head->prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        head->prev = head->next = head;
+
+        while (pending.next != &pending)
+        {
+            chat_timer_t* timer = pending.next;
+            cancelTimer(timer);
+            if (timer->expires > now)
+                linkTimer(wheel, timer); // Due in a later revolution
+            else
+                timer->callback(timer, arg);
+        }
+
+        if (head->next == head)
+            wheel->occupied[slot / 64] &= ~(1ull << (slot % 64));
+    }
+    wheel->current = now;
+}
@@ -0,0 +1,125 @@
+#ifndef CHAT_TIMER_H
+#define CHAT_TIMER_H
+
+#include <stdint.h>
+
+/*
+ * Hashed timing wheel. Time is divided into ticks of TIMER_TICK_MS milliseconds and a
+ * timer is linked into the slot of the tick it expires at, modulo the number of slots;
+ * timers further away than one revolution share a slot with nearer ones and are skipped
+ * until their turn comes. Scheduling and cancelling a timer are O(1), and advancing the
+ * wheel only visits the slots of the ticks that passed. A bitmap of non-empty slots
+ * lets the event loop find how long it may sleep without walking the timers.
+ */
+
+/* Resolution of the wheel. */
+#define TIMER_TICK_MS 100
+#define TIMER_WHEEL_BITS 9
+/* Number of slots; one revolution covers TIMER_WHEEL_SLOTS * TIMER_TICK_MS milliseconds. */
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+struct chat_timer;
+
+/*
+ * Callback invoked by advanceTimers when a timer expires. The timer is no longer
+ * pending and may be scheduled again from the callback.
+ */
+typedef void (*timer_callback_t)(struct chat_timer* timer, void* arg);
+
+/*
+ * A timer, embedded in the structure it belongs to. Pending timers are linked into a
+ * circular list with the slot as sentinel, so they can be unlinked without the wheel.
+ */
+typedef struct chat_timer {
+    struct chat_timer *prev;
+    struct chat_timer *next;
+    /* Tick at which the timer expires. */
+    uint64_t expires;
+    /* Invoked when the timer expires. */
+    timer_callback_t callback;
+    /* Owner of the timer, for the callback. */
+    void *data;
+}chat_timer_t;
+
+/*
+ * Data structure to keep track of the pending timers.
+ */
+typedef struct timer_wheel {
+    /* Sentinels of the slots' timer lists. */
+    chat_timer_t slots[TIMER_WHEEL_SLOTS];
+    /* Bit set for slots that may hold timers; cleared lazily when found empty. */
+    uint64_t occupied[TIMER_WHEEL_SLOTS / 64];
+    /* Last tick processed. */
+    uint64_t current;
+    /* Time of the last advance, in milliseconds of currentTimeMs. */
+    long long now_ms;
+}timer_wheel_t;
+
+/**
+ * Returns the time of the monotonic clock in milliseconds.
+ */
+long long currentTimeMs(void);
+
+/**
+ * Initializes a timer wheel with no pending timers.
+ *
+ * @param wheel: A pointer to the timer_wheel_t structure to initialize.
+ * @param now_ms: The current time, from currentTimeMs.
+ */
+void initTimerWheel(timer_wheel_t* wheel, long long now_ms);
+
+/**
+ * Initializes a timer that is not pending.
+ *
+ * @param timer: A pointer to the chat_timer_t structure to initialize.
+ * @param callback: The function invoked when the timer expires.
+ * @param data: The owner of the timer, available to the callback.
+ */
+void initTimer(chat_timer_t* timer, timer_callback_t callback, void* data);
+
+/**
+ * Schedules a timer to expire after a delay from the time of the wheel's last advance,
+ * rounded up to whole ticks. A pending timer is rescheduled.
+ *
+ * @param wheel: A pointer to the timer wheel.
+ * @param timer: A pointer to the timer to schedule.
+ * @param delay_ms: The delay in milliseconds.
+ */
+void scheduleTimer(timer_wheel_t* wheel, chat_timer_t* timer, long long delay_ms);
+
+/**
+ * Cancels a timer. Cancelling a timer that is not pending has no effect.
+ *
+ * @param timer: A pointer to the timer to cancel.
+ */
+void cancelTimer(chat_timer_t* timer);
+
+/**
+ * Returns non-zero if the timer is pending.
+ *
+ * @param timer: A pointer to the timer.
+ */
+int timerPending(const chat_timer_t* timer);
+
+/**
+ * Returns how long the event loop may wait before the next timer can expire, measured
+ * from the wheel's last advance. The result may be early for timers more than one
+ * revolution away, in which case advancing the wheel simply finds nothing to do.
+ *
+ * @param wheel: A pointer to the timer wheel.
+ * @return: The number of milliseconds, or -1 if no timer is pending.
+ */
+long long nextTimerTimeout(timer_wheel_t* wheel);
+
+/**
+ * Advances the wheel to the given time and invokes the callback of every timer that
+ * expired, in no particular order within a tick.
+ *
+ * @param wheel: A pointer to the timer wheel.
+ * @param now_ms: The current time, from currentTimeMs.
+ * @param arg: Passed to the callbacks.
+ */
+void advanceTimers(timer_wheel_t* wheel, long long now_ms, void* arg);
+
+#endif
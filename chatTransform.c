@@ -0,0 +1,248 @@
+#include "chatTransform.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+
+/* Words masked by the profanity stage. */
+static const char* const profanity_words[] = { "damn", "hell", "crap", "shit", "fuck", "bastard" };
+#define NR_PROFANITY_WORDS (sizeof(profanity_words) / sizeof(profanity_words[0]))
+
+#define RATE_TAG_LEN ((int)sizeof(TRANSFORM_RATE_TAG_TEXT) - 1)
+
+/*
+ * Byte-wise stages are a mapping and a filter of single bytes. TRANSFORM_KERNEL expands
+ * into three loops for a given mapping and filter, with both inlined: a check for bytes
+ * to drop, then either the mapping in place or, if there are bytes to drop, a loop that
+ * maps and compacts. Every message thus takes two passes, whatever the number of fused
+ * stages. The check and the mapping have no dependence between iterations and are
+ * vectorized by the compiler, which the compacting loop is not; one compacting pass
+ * would be fewer passes but slower for the usual message with nothing to drop.
+ */
+#define MAP_SAME(c) (c)
+/* toupper of the C locale, which the server runs in, without the table lookup. */
+#define MAP_UPPER(c) ((c) >= 'a' && (c) <= 'z' ? (c) - ('a' - 'A') : (c))
+#define KEEP_ALL(c) 1
+/* Drops the control characters, the bytes below a space and DEL; UTF-8 sequences stay. */
+#define KEEP_PRINTING(c) ((c) >= 0x20 && (c) != 0x7f)
+
+#define TRANSFORM_KERNEL(name, MAP, KEEP) \
+    static inline int name(char* message, int len) \
+    { \
+        /* Messages rarely have bytes to drop; without any, the bytes are mapped in place */ \
+        int dropped = 0; \
+        for (int i = 0; i < len; i++) \
+            dropped |= !KEEP((unsigned char)message[i]); \
+        if (!dropped) \
+        { \
+            for (int i = 0; i < len; i++) \
+                message[i] = (char)MAP((unsigned char)message[i]); \
+            return len; \
+        } \
+        int out = 0; \
+        for (int i = 0; i < len; i++) \
+        { \
+            unsigned char c = (unsigned char)message[i]; \
+            if (KEEP(c)) \
+                message[out++] = (char)MAP(c); \
+        } \
+        return out; \
+    }
+
+TRANSFORM_KERNEL(uppercaseKernel, MAP_UPPER, KEEP_ALL)
+TRANSFORM_KERNEL(stripKernel, MAP_SAME, KEEP_PRINTING)
+TRANSFORM_KERNEL(uppercaseStripKernel, MAP_UPPER, KEEP_PRINTING)
+
+void capitalizeMessage(char* message, int length)
+{
+    uppercaseKernel(message, length);
+}
+
+/*
+ * Masks the listed words. A word is a run of letters and digits, so that "hello" is
+ * left alone while "Hell!" is masked.
+ */
+static int profanityStage(char* message, int len)
+{
+    int i = 0;
+    while (i < len)
+    {
+        if (!isalnum((unsigned char)message[i]))
+        {
+            i++;
+            continue;
+        }
+
+        int start = i;
+        while (i < len && isalnum((unsigned char)message[i]))
+            i++;
+        size_t word_len = (size_t)(i - start);
+        for (size_t w = 0; w < NR_PROFANITY_WORDS; w++)
+        {
+            if (strlen(profanity_words[w]) == word_len && strncasecmp(message + start, profanity_words[w], word_len) == 0)
+            {
+                memset(message + start, '*', word_len);
+                break;
+            }
+        }
+    }
+    return len;
+}
+
+/*
+ * Counts the sender's messages in one-second windows and tags those past the limit.
+ */
+static int rateTagStage(char* message, int len, int param, transform_ctx_t* ctx)
+{
+    transform_rate_t* rate = ctx->rate;
+    if (ctx->now_ms - rate->window_start >= 1000)
+    {
+        rate->window_start = ctx->now_ms;
+        rate->count = 0;
+    }
+    if (++rate->count <= param)
+        return len;
+
+    memmove(message + RATE_TAG_LEN, message, (size_t)len);
+    memcpy(message, TRANSFORM_RATE_TAG_TEXT, RATE_TAG_LEN);
+    return len + RATE_TAG_LEN;
+}
+
+/* The stages, indexed by TRANSFORM_*; fused kernels have no name. */
+static const struct {
+    const char *name;
+    /* Smallest valid parameter, or -1 for a stage that takes none. */
+    int param_min;
+    /* Bytes the stage may add to a message. */
+    int growth;
+} transforms[NR_TRANSFORMS] = {
+    [TRANSFORM_UPPERCASE] = { "uppercase", -1, 0 },
+    [TRANSFORM_PROFANITY] = { "profanity", -1, 0 },
+    [TRANSFORM_LENGTH_CAP] = { "cap", 1, 0 },
+    [TRANSFORM_RATE_TAG] = { "ratetag", 0, RATE_TAG_LEN },
+    [TRANSFORM_STRIP] = { "strip", -1, 0 },
+    [TRANSFORM_UPPERCASE_STRIP] = { NULL, -1, 0 },
+};
+
+/* Adjacent stages that run as one fused kernel, in either order. */
+static const struct {
+    int first;
+    int second;
+    int fused;
+} fusions[] = {
+    { TRANSFORM_UPPERCASE, TRANSFORM_STRIP, TRANSFORM_UPPERCASE_STRIP },
+    { TRANSFORM_STRIP, TRANSFORM_UPPERCASE, TRANSFORM_UPPERCASE_STRIP },
+};
+#define NR_FUSIONS (sizeof(fusions) / sizeof(fusions[0]))
+
+void initTransforms(transform_pipeline_t* pipeline)
+{
+    memset(pipeline, 0, sizeof(*pipeline));
+    pipeline->stages[0].type = TRANSFORM_UPPERCASE;
+    pipeline->nr_stages = 1;
+}
+
+/*
+ * Finds the stage with the given name. Returns its TRANSFORM_* index, or -1.
+ */
+static int findTransform(const char* name, size_t len)
+{
+    for (int i = 0; i < NR_TRANSFORMS; i++)
+        if (transforms[i].name && strlen(transforms[i].name) == len && strncmp(transforms[i].name, name, len) == 0)
+            return i;
+    return -1;
+}
+
+/*
+ * Replaces each pair of adjacent stages that has a fused kernel with the fused stage.
+ */
+static void fuseTransforms(transform_pipeline_t* pipeline)
+{
+    int nr_stages = 0;
+    for (int i = 0; i < pipeline->nr_stages; i++)
+    {
+        transform_stage_t stage = pipeline->stages[i];
+        for (size_t f = 0; f < NR_FUSIONS && i + 1 < pipeline->nr_stages; f++)
+        {
+            if (fusions[f].first == stage.type && fusions[f].second == pipeline->stages[i + 1].type)
+            {
+                stage.type = fusions[f].fused;
+                i++;
+                break;
+            }
+        }
+        pipeline->stages[nr_stages++] = stage;
+    }
+    pipeline->nr_stages = nr_stages;
+}
+
+int parseTransforms(const char* spec, transform_pipeline_t* pipeline)
+{
+    transform_pipeline_t parsed;
+    memset(&parsed, 0, sizeof(parsed));
+    if (strcmp(spec, "none") == 0)
+    {
+        *pipeline = parsed;
+        return 0;
+    }
+
+    int used[NR_TRANSFORMS] = { 0 };
+    while (*spec != '\0')
+    {
+        size_t len = strcspn(spec, ",");
+        const char* equals = memchr(spec, '=', len);
+        size_t name_len = equals ? (size_t)(equals - spec) : len;
+
+        int type = findTransform(spec, name_len);
+        if (type < 0 || used[type] || (equals != NULL) != (transforms[type].param_min >= 0))
+            return -1;
+
+        int param = 0;
+        if (equals)
+        {
+            char* end;
+            errno = 0;
+            long value = strtol(equals + 1, &end, 10);
+            if (end == equals + 1 || end != spec + len || errno != 0 || value < transforms[type].param_min || value > INT_MAX)
+                return -1;
+            param = (int)value;
+        }
+
+        used[type] = 1;
+        parsed.stages[parsed.nr_stages].type = type;
+        parsed.stages[parsed.nr_stages].param = param;
+        parsed.nr_stages++;
+        parsed.growth += transforms[type].growth;
+
+        spec += len;
+        if (*spec == ',')
+            spec++;
+    }
+
+    if (parsed.nr_stages == 0)
+        return -1;
+    fuseTransforms(&parsed);
+    *pipeline = parsed;
+    return 0;
+}
+
+int applyTransforms(const transform_pipeline_t* pipeline, char* message, int len, transform_ctx_t* ctx)
+{
+    // The stage functions are static, so each case is a direct call the compiler can inline
+    for (int i = 0; i < pipeline->nr_stages; i++)
+    {
+        const transform_stage_t* stage = &pipeline->stages[i];
+        switch (stage->type)
+        {
+            case TRANSFORM_UPPERCASE: len = uppercaseKernel(message, len); break;
+            case TRANSFORM_PROFANITY: len = profanityStage(message, len); break;
+            case TRANSFORM_LENGTH_CAP: len = len > stage->param ? stage->param : len; break;
+            case TRANSFORM_RATE_TAG: len = rateTagStage(message, len, stage->param, ctx); break;
+            case TRANSFORM_STRIP: len = stripKernel(message, len); break;
+            case TRANSFORM_UPPERCASE_STRIP: len = uppercaseStripKernel(message, len); break;
+        }
+    }
+    return len;
+}
@@ -0,0 +1,118 @@
+#ifndef CHAT_TRANSFORM_H
+#define CHAT_TRANSFORM_H
+
+/*
+ * Pipeline of transforms applied to chat messages before they are broadcast. The stages
+ * are chosen at startup from a fixed set and run in order over the message buffer, in
+ * place; each may change the bytes and shorten or lengthen the message. The pipeline
+ * only holds the stages' indexes and parameters, and applying it switches on the index
+ * to call the stage directly, with no function pointers. Stages that work byte by byte
+ * are generated from one kernel template, and adjacent ones are fused into a single
+ * kernel when the pipeline is parsed, so "uppercase,strip" costs what one such stage
+ * costs: a pass that checks for bytes to drop, then either a pass that maps the bytes in
+ * place or, if some must go, a pass that maps and compacts them.
+ */
+
+/* Stages that can be configured. */
+#define TRANSFORM_UPPERCASE 0
+#define TRANSFORM_PROFANITY 1
+#define TRANSFORM_LENGTH_CAP 2
+#define TRANSFORM_RATE_TAG 3
+#define TRANSFORM_STRIP 4
+/* Maximum number of stages of a pipeline; a stage appears at most once. */
+#define MAX_TRANSFORM_STAGES 5
+/* Fused kernel parseTransforms substitutes for uppercase and strip in a row. */
+#define TRANSFORM_UPPERCASE_STRIP 5
+#define NR_TRANSFORMS 6
+/* Prefix the rate tag stage puts in front of the messages of a fast sender. */
+#define TRANSFORM_RATE_TAG_TEXT "[flood] "
+/* Bytes a pipeline may add to a message; only the rate tag stage lengthens messages. */
+#define TRANSFORM_MAX_GROWTH (sizeof(TRANSFORM_RATE_TAG_TEXT) - 1)
+
+/*
+ * Messages a connection sent in the current second, counted by the rate tag stage.
+ */
+typedef struct transform_rate {
+    /* Start of the current one-second window, in milliseconds. */
+    long long window_start;
+    int count;
+}transform_rate_t;
+
+/*
+ * What the stages know about the message they transform.
+ */
+typedef struct transform_ctx {
+    /* Current time in milliseconds. */
+    long long now_ms;
+    /* The sender's message count. */
+    transform_rate_t *rate;
+}transform_ctx_t;
+
+/*
+ * One stage of a pipeline.
+ */
+typedef struct transform_stage {
+    /* Which stage or fused kernel (TRANSFORM_*). */
+    int type;
+    /* Length of the length cap, message count of the rate tag; unused otherwise. */
+    int param;
+}transform_stage_t;
+
+/*
+ * The configured stages, in the order they run, with adjacent byte-wise stages fused.
+ */
+typedef struct transform_pipeline {
+    transform_stage_t stages[MAX_TRANSFORM_STAGES];
+    int nr_stages;
+    /* Bytes the pipeline may add to a message, 0 if it never lengthens one. */
+    int growth;
+}transform_pipeline_t;
+
+/**
+ * Capitalizes all alphabetic characters in a given string. This function iterates
+ * through each character of the string and converts it to uppercase if it is alphabetic.
+ * It runs the kernel of the uppercase stage.
+ *
+ * @param message: The string to be capitalized. This string is modified in place.
+ * @param length: The length of the string.
+ */
+void capitalizeMessage(char* message, int length);
+
+/**
+ * Fills a pipeline with the default stages: uppercase only.
+ *
+ * @param pipeline: The pipeline to initialize.
+ */
+void initTransforms(transform_pipeline_t* pipeline);
+
+/**
+ * Parses a pipeline description: a comma-separated list of stages, run in the given order,
+ * or "none" for a pipeline that leaves messages as they are. The stages are:
+ *   - uppercase: capitalizes the message.
+ *   - profanity: masks the words of a built-in list with '*', whatever their case.
+ *   - strip: removes control characters (bytes below a space, and DEL).
+ *   - cap=<bytes>: cuts the message to at most this many bytes.
+ *   - ratetag=<count>: prefixes TRANSFORM_RATE_TAG_TEXT to the messages a connection sends
+ *     once it sent more than count messages within the current second.
+ *
+ * @param spec: The description.
+ * @param pipeline: Receives the pipeline; left unchanged if the description is invalid.
+ * @return
+ *   - 0 on success.
+ *   - -1 if a stage is unknown, repeated or has an invalid parameter.
+ */
+int parseTransforms(const char* spec, transform_pipeline_t* pipeline);
+
+/**
+ * Runs a message through the pipeline, in place. The buffer must have room for
+ * pipeline->growth bytes past the end of the message.
+ *
+ * @param pipeline: The pipeline.
+ * @param message: The message, modified in place.
+ * @param len: The length of the message.
+ * @param ctx: The sender and the current time.
+ * @return: The new length of the message.
+ */
+int applyTransforms(const transform_pipeline_t* pipeline, char* message, int len, transform_ctx_t* ctx);
+
+#endif
@@ -0,0 +1,487 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include "chatShm.h"
+
+#define MAX_MESSAGE_SIZE 65536
+#define RECV_BUFFER_SIZE 65536
+#define LATENCY_BUCKETS 40
+
+/* Binary framing protocol, see chatServer.h. */
+#define FRAME_HELLO "\xB1" "CH\x01"
+#define FRAME_HELLO_SIZE 4
+#define FRAME_HEADER_SIZE 8
+#define FRAME_MSG 1
+
+/*
+ * State of one simulated chat client.
+ */
+typedef struct client {
+    /* Socket connected to the server. */
+    int fd;
+    /* Number of messages completely written to the server. */
+    long sent;
+    /* Bytes of the current outgoing message already written. */
+    int offset;
+    /* Length of the current outgoing message, 0 if none is prepared. */
+    int out_len;
+    /* Number of complete lines received from the server. */
+    long received;
+    /* Timestamp parsed from the beginning of the line currently being received. */
+    uint64_t stamp;
+    /* Non-zero while the digits at the start of the current line are being parsed. */
+    int in_stamp;
+    /* Binary mode: bytes of the server's hello still to be skipped. */
+    int skip;
+    /* Binary mode: header of the frame being received and how much of it arrived. */
+    unsigned char header[FRAME_HEADER_SIZE];
+    int header_len;
+    /* Binary mode: payload bytes of the current frame still to be received. */
+    uint32_t payload_left;
+    /* Shared-memory ring the messages are sent through in -M mode. */
+    shm_ring_t ring;
+}client_t;
+
+/*
+ * Parameters of a load test run, filled from the command line.
+ */
+typedef struct load_options {
+    const char* host;
+    const char* port;
+    /* Path of the server's Unix socket, or NULL to connect over TCP. */
+    const char* unix_path;
+    /* Type of the Unix socket (SOCK_STREAM or SOCK_SEQPACKET). */
+    int unix_type;
+    /* Non-zero to send through the shared-memory ring of a shm listener. */
+    int shm;
+    /* Number of simulated clients. */
+    int connections;
+    /* Messages sent by each client. */
+    long messages;
+    /* Size of each message in bytes, including the trailing newline. */
+    int size;
+    /* Per-client send rate in messages per second, 0 for unlimited. */
+    long rate;
+    /* Delay between connecting and sending so the server can accept everyone. */
+    int settle_ms;
+    /* Seconds without progress after which the run is considered finished. */
+    int idle_timeout;
+    /* Non-zero to use the binary framing protocol instead of text lines. */
+    int binary;
+}load_options_t;
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: loadGenerator [-h host] [-p port] [-u path [-M] | -U path] [-c connections]\n"
+                    "                     [-n messages] [-s size] [-r rate] [-w settle_ms] [-t idle_timeout] [-b]\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Sends the binary hello if needed and makes a connected socket non-blocking.
+ */
+static int startClient(int fd, const load_options_t* opts)
+{
+    if (opts->binary && write(fd, FRAME_HELLO, FRAME_HELLO_SIZE) != FRAME_HELLO_SIZE)
+    {
+        perror("write failed");
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/*
+ * Connects to the server's Unix socket.
+ */
+static int connectUnix(const load_options_t* opts)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(opts->unix_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", opts->unix_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, opts->unix_path);
+
+    int fd = socket(AF_UNIX, opts->unix_type, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        perror("connect failed");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int connectClient(const load_options_t* opts, client_t* client)
+{
+    if (opts->unix_path)
+    {
+        // The server's first message on a shm listener carries the ring
+        int fd = connectUnix(opts);
+        if (fd >= 0 && opts->shm && receiveShmRing(fd, &client->ring) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+        return fd < 0 ? -1 : startClient(fd, opts);
+    }
+
+    struct addrinfo hints, *res, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(opts->host, opts->port, &hints, &res) != 0)
+    {
+        fprintf(stderr, "Cannot resolve %s:%s\n", opts->host, opts->port);
+        return -1;
+    }
+
+    int fd = -1;
+    for (ai = res; ai != NULL; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0)
+    {
+        perror("connect failed");
+        return -1;
+    }
+
+    return startClient(fd, opts);
+}
+
+/*
+ * Formats the next outgoing message: the send timestamp in decimal, padded with
+ * filler characters up to the requested size. Text messages are terminated by a
+ * newline; binary messages carry the same body in a MSG frame for the lobby.
+ */
+static int prepareMessage(char* out, int size, int binary)
+{
+    char* body = binary ? out + FRAME_HEADER_SIZE : out;
+    int len = snprintf(body, MAX_MESSAGE_SIZE - FRAME_HEADER_SIZE, "%llu ", (unsigned long long)nowNs());
+    if (len < size - 1)
+    {
+        memset(body + len, 'x', size - 1 - len);
+        len = size - 1;
+    }
+
+    if (!binary)
+    {
+        body[len++] = '\n';
+        return len;
+    }
+
+    uint32_t net_length = htonl((uint32_t)len);
+    memset(out, 0, FRAME_HEADER_SIZE); // Lobby, no flags
+    out[0] = FRAME_MSG;
+    memcpy(out + 4, &net_length, sizeof(net_length));
+    return FRAME_HEADER_SIZE + len;
+}
+
+static void recordLatency(long* histogram, uint64_t latency_ns)
+{
+    uint64_t us = latency_ns / 1000;
+    int bucket = 0;
+    while (us > 0 && bucket < LATENCY_BUCKETS - 1)
+    {
+        us >>= 1;
+        bucket++;
+    }
+    histogram[bucket]++;
+}
+
+static uint64_t latencyPercentile(const long* histogram, long total, double pct)
+{
+    long target = (long)(total * pct), seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += histogram[i];
+        if (seen > target)
+            return 1ull << i;
+    }
+    return 1ull << (LATENCY_BUCKETS - 1);
+}
+
+/*
+ * Accounts for one completely received message and measures its latency from
+ * the timestamp parsed out of its body.
+ */
+static void finishMessage(client_t* client, long* histogram, uint64_t* latency_sum)
+{
+    uint64_t now = nowNs();
+    if (client->stamp != 0 && client->stamp <= now)
+    {
+        recordLatency(histogram, now - client->stamp);
+        *latency_sum += now - client->stamp;
+    }
+    client->received++;
+    client->stamp = 0;
+    client->in_stamp = 1;
+}
+
+static void parseStamp(client_t* client, char c)
+{
+    if (c >= '0' && c <= '9')
+        client->stamp = client->stamp * 10 + (uint64_t)(c - '0');
+    else
+        client->in_stamp = 0;
+}
+
+/*
+ * Consumes received bytes: counts complete messages (lines or frames) and measures
+ * the latency of each one from the timestamp embedded by the sender.
+ */
+static void consumeInput(client_t* client, const char* buf, ssize_t len, int binary, long* histogram, uint64_t* latency_sum)
+{
+    for (ssize_t i = 0; i < len; i++)
+    {
+        char c = buf[i];
+        if (!binary)
+        {
+            if (c == '\n')
+                finishMessage(client, histogram, latency_sum);
+            else if (client->in_stamp)
+                parseStamp(client, c);
+        }
+        else if (client->skip > 0)
+            client->skip--;
+        else if (client->header_len < FRAME_HEADER_SIZE)
+        {
+            client->header[client->header_len++] = (unsigned char)c;
+            if (client->header_len == FRAME_HEADER_SIZE)
+            {
+                uint32_t net_length;
+                memcpy(&net_length, client->header + 4, sizeof(net_length));
+                client->payload_left = ntohl(net_length);
+                if (client->payload_left == 0)
+                {
+                    finishMessage(client, histogram, latency_sum);
+                    client->header_len = 0;
+                }
+            }
+        }
+        else
+        {
+            if (client->in_stamp)
+                parseStamp(client, c);
+            if (--client->payload_left == 0)
+            {
+                finishMessage(client, histogram, latency_sum);
+                client->header_len = 0;
+            }
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    load_options_t opts = { "127.0.0.1", "8080", NULL, SOCK_STREAM, 0, 50, 1000, 64, 0, 500, 5, 0 };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:u:U:Mc:n:s:r:w:t:b")) != -1)
+    {
+        switch (opt)
+        {
+            case 'h': opts.host = optarg; break;
+            case 'p': opts.port = optarg; break;
+            case 'u': opts.unix_path = optarg; opts.unix_type = SOCK_STREAM; break;
+            case 'U': opts.unix_path = optarg; opts.unix_type = SOCK_SEQPACKET; break;
+            case 'M': opts.shm = 1; break;
+            case 'c': opts.connections = atoi(optarg); break;
+            case 'n': opts.messages = atol(optarg); break;
+            case 's': opts.size = atoi(optarg); break;
+            case 'r': opts.rate = atol(optarg); break;
+            case 'w': opts.settle_ms = atoi(optarg); break;
+            case 't': opts.idle_timeout = atoi(optarg); break;
+            case 'b': opts.binary = 1; break;
+            default: usage();
+        }
+    }
+
+    if (opts.connections < 1 || opts.connections >= FD_SETSIZE - 16 || opts.messages < 1 ||
+        opts.size < 24 || opts.size > MAX_MESSAGE_SIZE - FRAME_HEADER_SIZE ||
+        (opts.shm && (!opts.unix_path || opts.unix_type != SOCK_STREAM || opts.size > SHM_MAX_RECORD)))
+        usage();
+
+    client_t* clients = (client_t*) calloc(opts.connections, sizeof(client_t));
+    char* out = (char*) malloc((size_t)opts.connections * MAX_MESSAGE_SIZE);
+    char* in = (char*) malloc(RECV_BUFFER_SIZE);
+    if (!clients || !out || !in)
+    {
+        fprintf(stderr, "malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int maxfd = -1;
+    for (int i = 0; i < opts.connections; i++)
+    {
+        clients[i].fd = connectClient(&opts, &clients[i]);
+        if (clients[i].fd < 0)
+            exit(EXIT_FAILURE);
+        clients[i].in_stamp = 1;
+        clients[i].skip = opts.binary ? FRAME_HELLO_SIZE : 0;
+        if (clients[i].fd > maxfd)
+            maxfd = clients[i].fd;
+    }
+    usleep((useconds_t)opts.settle_ms * 1000);
+
+    // Every message is broadcast to every other client.
+    long expected = (long)opts.connections * (opts.connections - 1) * opts.messages;
+    long total_received = 0, total_sent = 0;
+    long histogram[LATENCY_BUCKETS] = {0};
+    uint64_t latency_sum = 0;
+    uint64_t start = nowNs(), last_progress = start;
+
+    while (total_received < expected)
+    {
+        uint64_t now = nowNs();
+        if (now - last_progress > (uint64_t)opts.idle_timeout * 1000000000ull)
+        {
+            fprintf(stderr, "No progress for %d seconds, stopping\n", opts.idle_timeout);
+            break;
+        }
+
+        fd_set read_set, write_set;
+        FD_ZERO(&read_set);
+        FD_ZERO(&write_set);
+        long allowed = opts.rate > 0 ? (long)((now - start) / 1000000000.0 * opts.rate) + 1 : opts.messages;
+        for (int i = 0; i < opts.connections; i++)
+        {
+            FD_SET(clients[i].fd, &read_set);
+            if (!opts.shm && clients[i].sent < opts.messages && clients[i].sent < allowed)
+                FD_SET(clients[i].fd, &write_set);
+        }
+
+        struct timeval tv = { 0, 10000 };
+        if (select(maxfd + 1, &read_set, &write_set, NULL, &tv) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("select failed");
+            break;
+        }
+
+        for (int i = 0; i < opts.connections; i++)
+        {
+            client_t* client = &clients[i];
+            if (FD_ISSET(client->fd, &read_set))
+            {
+                ssize_t n;
+                while ((n = read(client->fd, in, RECV_BUFFER_SIZE)) > 0)
+                {
+                    long before = client->received;
+                    consumeInput(client, in, n, opts.binary, histogram, &latency_sum);
+                    total_received += client->received - before;
+                    last_progress = nowNs();
+                }
+                if (n == 0)
+                {
+                    fprintf(stderr, "Server closed connection\n");
+                    expected = total_received;
+                }
+            }
+
+            // Ring clients publish as long as there is room, without a system call
+            if (opts.shm)
+            {
+                char* msg = out + (size_t)i * MAX_MESSAGE_SIZE;
+                while (client->sent < opts.messages && client->sent < allowed)
+                {
+                    int len = prepareMessage(msg, opts.size, 0);
+                    if (publishShmRecord(&client->ring, msg, (uint32_t)len) != 0)
+                        break;
+                    client->sent++;
+                    total_sent++;
+                    last_progress = nowNs();
+                }
+            }
+
+            else if (FD_ISSET(client->fd, &write_set))
+            {
+                char* msg = out + (size_t)i * MAX_MESSAGE_SIZE;
+                while (client->sent < opts.messages && client->sent < allowed)
+                {
+                    if (client->out_len == 0)
+                        client->out_len = prepareMessage(msg, opts.size, opts.binary);
+
+                    ssize_t n = write(client->fd, msg + client->offset, client->out_len - client->offset);
+                    if (n <= 0)
+                        break;
+                    client->offset += (int)n;
+                    if (client->offset == client->out_len)
+                    {
+                        client->sent++;
+                        total_sent++;
+                        client->offset = client->out_len = 0;
+                    }
+                    last_progress = nowNs();
+                }
+            }
+        }
+    }
+
+    double elapsed = (double)(nowNs() - start) / 1e9;
+    long measured = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+        measured += histogram[i];
+
+    printf("transport:     %s\n", opts.shm ? "shared ring" : !opts.unix_path ? "tcp" :
+                                     opts.unix_type == SOCK_SEQPACKET ? "unix seqpacket" : "unix stream");
+    printf("connections:   %d\n", opts.connections);
+    printf("protocol:      %s\n", opts.binary ? "binary" : "text");
+    printf("message size:  %d bytes\n", opts.size);
+    printf("elapsed:       %.3f s\n", elapsed);
+    printf("sent:          %ld msgs (%.0f msgs/s)\n", total_sent, total_sent / elapsed);
+    printf("delivered:     %ld/%ld msgs (%.0f msgs/s, %.2f MB/s)\n", total_received, expected,
+           total_received / elapsed, total_received * (double)opts.size / elapsed / 1e6);
+    if (measured > 0)
+        printf("latency:       avg %.1f us, p50 < %llu us, p99 < %llu us\n",
+               (double)latency_sum / measured / 1000.0,
+               (unsigned long long)latencyPercentile(histogram, measured, 0.50),
+               (unsigned long long)latencyPercentile(histogram, measured, 0.99));
+
+    for (int i = 0; i < opts.connections; i++)
+    {
+        if (opts.shm)
+            closeShmRing(&clients[i].ring);
+        close(clients[i].fd);
+    }
+    free(clients);
+    free(out);
+    free(in);
+
+    return total_received == expected ? EXIT_SUCCESS : EXIT_FAILURE;
+}
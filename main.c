@@ -0,0 +1,342 @@
+#include "chatServer.h"
+#include "chatHandoff.h"
+
+/* Set by the signal handler to request a graceful shutdown of the main loop. */
+static volatile sig_atomic_t end_server = 0;
+
+/* Set by the SIGHUP handler to request a reload of the configuration file. */
+static volatile sig_atomic_t reload_config = 0;
+
+void intHandler(int SIG_INT)
+{
+    (void)SIG_INT; // Explicitly mark the parameter as unused
+    end_server = 1;
+}
+
+void hupHandler(int SIG_HUP)
+{
+    (void)SIG_HUP;
+    reload_config = 1;
+}
+
+/*
+ * Delivers what is still queued before the server exits. No new connections are accepted
+ * and no more input is processed, but the write queues keep being flushed. Once a
+ * connection's queue is empty its sending side is shut down and its input discarded until
+ * the peer closes, so that closing the socket does not reset the connection while the
+ * last messages are in flight. Gives up once the drain timeout passes or another signal
+ * arrives.
+ */
+static void drainConnections(conn_pool_t* pool, int timeout_ms)
+{
+    long long deadline = currentTimeMs() + timeout_ms;
+    end_server = 0; // A second signal cuts the drain short
+    PRINT_INFO(pool, "Draining %u connections\n", pool->nr_conns);
+
+    // Input is only watched on connections whose output has been shut down
+    FD_ZERO(&pool->read_set);
+    flushPendingWrites(pool);
+
+    while (pool->conn_head != NULL && !end_server)
+    {
+        for (conn_t* conn = pool->conn_head; conn != NULL; conn = conn->next)
+        {
+            if (conn->write_msg_head == NULL && !FD_ISSET(conn->fd, &pool->read_set))
+            {
+                shutdown(conn->fd, SHUT_WR);
+                FD_SET(conn->fd, &pool->read_set);
+            }
+        }
+
+        long long remaining = deadline - currentTimeMs();
+        if (remaining <= 0)
+            break;
+        struct timeval timeout = { (time_t)(remaining / 1000), (suseconds_t)(remaining % 1000) * 1000 };
+
+        pool->ready_read_set = pool->read_set;
+        pool->ready_write_set = pool->write_set;
+        if (select(pool->maxfd + 1, &pool->ready_read_set, &pool->ready_write_set, NULL, &timeout) <= 0)
+            continue;
+
+        conn_t* next;
+        for (conn_t* conn = pool->conn_head; conn != NULL; conn = next)
+        {
+            next = conn->next;
+            int sd = conn->fd;
+            if (FD_ISSET(sd, &pool->ready_write_set))
+                conn->write_blocked = 0;
+            if (FD_ISSET(sd, &pool->ready_read_set))
+            {
+                char discard[BUFFER_SIZE];
+                ssize_t received = recv(sd, discard, sizeof(discard), MSG_DONTWAIT);
+                if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                {
+                    // The peer has everything and closed its side
+                    removeConn(sd, pool);
+                    updateMaxFd(pool);
+                }
+            }
+        }
+
+        flushPendingWrites(pool);
+    }
+
+    if (pool->conn_head != NULL)
+        PRINT_INFO(pool, "Closing %u connections before they finished draining\n", pool->nr_conns);
+}
+
+static void usage(void)
+{
+    printf("Usage: server [-d] [-z bytes] [-r count] [-L dir] [-f sync] [-H path] [-g ms] [-i sec] [-p sec] [-m msgs] [-b bytes] [-n count] [-q bytes] [-o opts] [-t stages] [-c file] [-v level] [-l address]... [port]\n"
+           "       server [options] -T path\n"
+           "  -l addr   listen on port, host:port, [ipv6]:port, unix:path, unixpacket:path or shm:path;\n"
+           "            may be repeated (port alone means -l port)\n"
+           "  -d        write messages directly when the recipient's queue is empty\n"
+           "  -z bytes  share broadcasts of at least this size and send them with MSG_ZEROCOPY\n"
+           "  -r count  keep the last count messages of each room and replay them on join\n"
+           "  -L dir    append every message to a log in dir and restore the histories from it\n"
+           "  -f sync   log sync policy: none, interval:<ms> (default interval:1000) or every:<n>\n"
+           "  -H path   accept a successor on a Unix socket at path and hand the server over to it\n"
+           "  -T path   take over the clients and listening sockets of the server handing over at path\n"
+           "  -g ms     on shutdown, keep delivering queued messages for up to ms milliseconds (default 5000, 0 disables)\n"
+           "  -i sec    close connections that sent nothing for sec seconds\n"
+           "  -p sec    ping binary connections that sent nothing for sec seconds\n"
+           "  -m msgs   limit each connection to msgs messages per second\n"
+           "  -b bytes  limit each connection to bytes bytes per second\n"
+           "  -n count  handle at most count messages per connection per loop iteration (default 64, 0 for no limit)\n"
+           "  -q bytes  close connections whose write queue would grow past bytes\n"
+           "  -o opts   socket options name[=value],...: nodelay, sndbuf, rcvbuf, notsent_lowat, busy_poll, defer_accept, backlog\n"
+           "  -t stages transforms applied to text messages, in order: uppercase, strip, profanity,\n"
+           "            cap=<bytes>, ratetag=<count>, or none (default uppercase)\n"
+           "  -c file   read settings from file, and again on SIGHUP\n"
+           "  -v level  progress messages: quiet, info (default) or debug\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[])
+{
+    server_config_t config;
+    initConfig(&config);
+    const char* config_path = NULL;
+    const char* addresses[MAX_LISTENERS + 1];
+    int nr_addresses = 0;
+
+    // Parse command line options
+    int opt;
+    while ((opt = getopt(argc, argv, "dz:r:L:f:H:T:g:i:p:m:b:n:q:o:t:c:v:l:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd': config.direct_write = 1; break;
+            case 'z': config.zerocopy_threshold = atoi(optarg); break;
+            case 'r': config.history_size = atoi(optarg); break;
+            case 'L': config.log_dir = optarg; break;
+            case 'H': config.handoff_path = optarg; break;
+            case 'T': config.takeover_path = optarg; break;
+            case 'g': config.drain_timeout = atoi(optarg); break;
+            case 'i': config.idle_timeout = atoi(optarg) * 1000; break;
+            case 'p': config.ping_interval = atoi(optarg) * 1000; break;
+            case 'm': config.rate_msgs = atoi(optarg); break;
+            case 'b': config.rate_bytes = atoi(optarg); break;
+            case 'n': config.read_budget = atoi(optarg); break;
+            case 'q': config.max_queue_bytes = atoi(optarg); break;
+            case 'f':
+                if (parseLogSync(optarg, &config.log_sync, &config.log_sync_param) != 0)
+                    usage();
+                break;
+            case 'o':
+                if (parseSocketOptions(optarg, &config) != 0)
+                    usage();
+                break;
+            case 't':
+                if (parseTransforms(optarg, &config.transforms) != 0)
+                    usage();
+                break;
+            case 'c':
+                // Options given after -c override the file
+                config_path = optarg;
+                if (loadConfigFile(config_path, &config, 0) != 0)
+                    exit(EXIT_FAILURE);
+                break;
+            case 'v':
+                if (parseVerbosity(optarg, &config.verbosity) != 0)
+                    usage();
+                break;
+            case 'l':
+                if (nr_addresses == MAX_LISTENERS)
+                    usage();
+                addresses[nr_addresses++] = optarg;
+                break;
+            default: usage();
+        }
+    }
+
+    // The port argument is short for -l port
+    if (argc - optind == 1)
+        addresses[nr_addresses++] = argv[optind++];
+
+    // Check command line arguments; a server taking over inherits its listeners
+    if (argc - optind != 0 || (nr_addresses == 0) != (config.takeover_path != NULL) || config.history_size < 0 || config.history_size > MAX_HISTORY_SIZE ||
+        config.drain_timeout < 0 || config.idle_timeout < 0 || config.ping_interval < 0 ||
+        config.rate_msgs < 0 || config.rate_bytes < 0 || config.read_budget < 0 || config.max_queue_bytes < 0)
+        usage();
+
+    // Register signal handlers for graceful shutdown
+    signal(SIGINT, intHandler);
+    signal(SIGTERM, intHandler);
+    if (config_path)
+        signal(SIGHUP, hupHandler);
+
+    // Initialize connection pool
+    conn_pool_t pool;
+    initPool(&pool);
+    pool.config = config;
+
+    // Create the listening sockets, or take them over with the clients of a running server
+    int takeover_socket = -1;
+    if (config.takeover_path && (takeover_socket = takeOverServer(config.takeover_path, &pool)) == -1)
+        exit(EXIT_FAILURE);
+    for (int i = 0; i < nr_addresses; i++)
+        if (addListener(&pool, addresses[i]) != 0)
+            exit(EXIT_FAILURE); // Server initialization failed
+
+    // Open the message log and bring back the histories of the previous run
+    if (config.log_dir)
+    {
+        pool.log = openLog(config.log_dir, config.log_sync, config.log_sync_param);
+        if (!pool.log)
+            exit(EXIT_FAILURE);
+        restoreHistory(&pool);
+    }
+
+    // The old server keeps the clients unless this one got this far; exiting leaves them alone
+    if (takeover_socket != -1 && completeTakeover(takeover_socket, &pool) != 0)
+        exit(EXIT_FAILURE);
+
+    // Listen for a successor; the path is free once a takeover is done, so both may be the same.
+    // After a takeover the clients are ours, so a failure only rules out the next handoff.
+    if (config.handoff_path)
+    {
+        pool.handoff_socket = listenForHandoff(config.handoff_path);
+        if (pool.handoff_socket == -1 && takeover_socket == -1)
+            exit(EXIT_FAILURE);
+        if (pool.handoff_socket != -1)
+            FD_SET(pool.handoff_socket, &pool.read_set);
+    }
+
+    updateMaxFd(&pool); // Taken over connections may have higher file descriptor numbers
+
+    // Set once the server was handed over to a successor
+    int handed_off = 0;
+
+    // Descriptor the scan starts at; it moves every iteration so that no connection is always served first
+    int scan_start = 0;
+
+    // Main server loop
+    do
+    {
+        // Copy file descriptor sets to avoid modifying the original sets
+        pool.ready_read_set = pool.read_set;
+        pool.ready_write_set = pool.write_set;
+
+        // Block until input arrives at one or more active sockets or the next timer is due;
+        // messages left over by the read budget or waiting in shared rings are handled without waiting
+        long long wait_ms = pool.nr_backlogged > 0 || armShmRings(&pool) ? 0 : nextTimerTimeout(&pool.timers);
+        struct timeval timeout = { (time_t)(wait_ms / 1000), (suseconds_t)(wait_ms % 1000) * 1000 };
+        PRINT_DEBUG(&pool, "Waiting on select()...\nMaxFd %d\n", pool.maxfd);
+        pool.nready = select(pool.maxfd + 1, &pool.ready_read_set, &pool.ready_write_set, NULL, wait_ms < 0 ? NULL : &timeout);
+
+        // Apply a new configuration between iterations; the signal interrupts select
+        if (reload_config)
+        {
+            reload_config = 0;
+            reloadConfig(&pool, config_path);
+        }
+        if (pool.nready < 0)
+            continue;
+
+        // Ping or close idle connections before reading, so reads see the current time
+        runTimers(&pool);
+
+        // Handle the messages producers appended to their shared rings
+        pollShmRings(&pool);
+
+        // Check each file descriptor in the set, or with a backlog, round-robin from scan_start
+        int nfds = pool.maxfd + 1;
+        for (int i = 0; i < nfds && (pool.nready > 0 || pool.nr_backlogged > 0); i++)
+        {
+            int sd = (scan_start + i) % nfds;
+
+            if (FD_ISSET(sd, &pool.ready_read_set))
+            {
+                if (pool.conns_by_fd[sd] != NULL)
+                {
+                    // Read data and add it to the clients' queues (or remove the client is disconnected)
+                    processDataFromConnection(sd, &pool);
+                }
+
+                else if (sd == pool.handoff_socket)
+                {
+                    // The successor now owns the clients; nothing more may be read or written
+                    if (handOffServer(&pool) == 0)
+                    {
+                        handed_off = 1;
+                        break;
+                    }
+                }
+
+                // Accept new connections on one of the listening sockets
+                else if (acceptNewConnection(sd, &pool) != 0) // Accept the new connection and add it to the connections list
+                    continue;
+
+                pool.nready--;
+            }
+
+            // Handle the messages a connection could not get through in the previous iteration
+            else if (pool.conns_by_fd[sd] != NULL && pool.conns_by_fd[sd]->backlogged && !pool.conns_by_fd[sd]->read_paused)
+                processDataFromConnection(sd, &pool);
+
+            // Connections whose socket buffer drained can be flushed again
+            if (FD_ISSET(sd, &pool.ready_write_set))
+            {
+                if (pool.conns_by_fd[sd] != NULL)
+                    pool.conns_by_fd[sd]->write_blocked = 0;
+                pool.nready--;
+            }
+        }
+
+        if (handed_off)
+            break;
+        scan_start = (scan_start + 1) % nfds;
+
+        // Send queued messages once all reads of this iteration have been processed
+        flushPendingWrites(&pool);
+    } while (!end_server);
+
+
+    // Stop accepting and let the clients receive what is queued for them; a successor has taken over otherwise
+    closeListeners(&pool, !handed_off);
+    if (pool.handoff_socket != -1)
+    {
+        closeHandoffSocket(&pool);
+        unlink(config.handoff_path);
+    }
+    if (!handed_off && pool.config.drain_timeout > 0)
+        drainConnections(&pool, pool.config.drain_timeout);
+
+    /* Cleanup connections on server shutdown; after a handoff this only closes our copies of the sockets */
+    conn_t* current = pool.conn_head;
+    while (current != NULL)
+    {
+        int current_fd = current->fd; // Store the current FD
+        conn_t* next = current->next; // Save the next connection
+        // Remove and cleanup the current connection
+        if (removeConn(current_fd, &pool) == 0)
+            PRINT_DEBUG(&pool, "removing connection with sd %d \n", current_fd);
+
+        current = next; // Move to the next connection
+    }
+
+    closeLog(pool.log);
+    destroyPool(&pool);
+}